@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -8,6 +8,8 @@
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
+// * bread_async and bwrite_async start the same I/O without
+//     waiting for it; call bwait before touching b->data.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -22,132 +24,457 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "rusage.h"
+#include "proc.h"
+#include "sysinfo.h"
 
+#define NBUCKET 13
+#define BPERPAGE 3   // buffers carved from each kalloc'd page
+#define BRECLAIM 16  // max pages breclaim() frees per call
+
+// Buffers beyond the first NBUF live in pages taken from
+// kalloc() while memory is plentiful, and are given back by
+// breclaim() when it runs short.
+struct bchunk {
+  struct buf buf[BPERPAGE];
+  struct bchunk *next;
+};
+
+// Buffers are spread over NBUCKET hash buckets by block number,
+// each with its own lock, so lookups of different blocks do not
+// contend. bcache.lock serializes evictions, which may have to
+// move a buffer from one bucket to another, and guards the rest
+// of bcache.
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
+  struct bchunk *chunks; // pages of extra buffers
+  int nbuf;              // total buffers, including buf[]
+  uint nmiss;            // lookups that had to allocate a buffer
+  uint nevict;           // ... by throwing out a cached block
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // Each bucket has a linked list of its buffers, through prev/next.
+  // Recency is kept in b->lastuse rather than by list order, so
+  // brelse() does not have to relink anything.
+  struct {
+    struct spinlock lock;
+    struct buf head;
+    uint nhit;           // lookups that found the block here
+  } bucket[NBUCKET];
 } bcache;
 
+static uint
+bhash(uint dev, uint blockno)
+{
+  return (dev + blockno) % NBUCKET;
+}
+
+// Add b to bucket h.
+// Caller must hold that bucket's lock.
+static void
+bpush(uint h, struct buf *b)
+{
+  struct buf *head = &bcache.bucket[h].head;
+
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+}
+
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  int i;
+
+  if(sizeof(struct bchunk) > PGSIZE)
+    panic("binit: bchunk");
 
   initlock(&bcache.lock, "bcache");
+  for(i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head.prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next = &bcache.bucket[i].head;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // Start with all the buffers in bucket 0; evictions
+  // move them to where they are needed.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bpush(0, b);
+  }
+  bcache.nbuf = NBUF;
+}
+
+// Add a page of fresh buffers to bucket h, and return one
+// of them. Caller must hold bcache.lock and the bucket's lock.
+// Growing is only for when memory is plentiful, so rather
+// than have kalloc() reclaim, which would take those and
+// other caches' locks, just fail.
+static struct buf*
+bgrow(uint h)
+{
+  struct bchunk *c;
+  int i;
+
+  if((c = (struct bchunk*)kalloc_noreclaim()) == 0)
+    return 0;
+  memset(c, 0, sizeof(*c));
+  for(i = 0; i < BPERPAGE; i++){
+    initsleeplock(&c->buf[i].lock, "buffer");
+    bpush(h, &c->buf[i]);
+  }
+  c->next = bcache.chunks;
+  bcache.chunks = c;
+  bcache.nbuf += BPERPAGE;
+  return &c->buf[0];
+}
+
+// Look for block on device dev in bucket h.
+// Caller must hold that bucket's lock.
+static struct buf*
+blookup(uint h, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bcache.bucket[h].head.next; b != &bcache.bucket[h].head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
   }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// For read-ahead (ahead set), return 0 instead if the block is
+// already cached or there is no buffer to spare.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ahead)
 {
-  struct buf *b;
+  struct buf *b, *best;
+  uint h = bhash(dev, blockno);
+  uint i, v;
+  int bh, found;
 
-  acquire(&bcache.lock);
+  acquire(&bcache.bucket[h].lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+  if((b = blookup(h, dev, blockno)) != 0){
+    if(ahead){
+      release(&bcache.bucket[h].lock);
+      return 0;
+    }
+    b->refcnt++;
+    bcache.bucket[h].nhit++;
+    release(&bcache.bucket[h].lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bcache.bucket[h].lock);
+
+  // Not cached. Only one eviction at a time, so that holding
+  // our bucket's lock while taking another's cannot deadlock.
+  acquire(&bcache.lock);
+  acquire(&bcache.bucket[h].lock);
+
+  // Someone else may have cached it while we were unlocked.
+  if((b = blookup(h, dev, blockno)) != 0){
+    if(ahead){
+      release(&bcache.bucket[h].lock);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    b->refcnt++;
+    bcache.bucket[h].nhit++;
+    release(&bcache.bucket[h].lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  bcache.nmiss++;
+
+  // Grow the cache rather than evict while memory is plentiful.
+  if(calfreemem() / PGSIZE > BRESERVE && (b = bgrow(h)) != 0)
+    goto found;
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  // Recycle the least recently used (LRU) unused buffer in the
+  // whole cache. Keep the lock of the bucket holding the best
+  // candidate so far, so that it cannot be taken from under us.
+  best = 0;
+  bh = -1;
+  for(i = 0; i < NBUCKET; i++){
+    v = (h + i) % NBUCKET;
+    if(v != h)
+      acquire(&bcache.bucket[v].lock);
+    found = 0;
+    for(b = bcache.bucket[v].head.next; b != &bcache.bucket[v].head; b = b->next){
+      if(b->refcnt == 0 && (best == 0 || b->lastuse < best->lastuse)){
+        best = b;
+        found = 1;
+      }
+    }
+    if(found){
+      if(bh >= 0 && bh != h)
+        release(&bcache.bucket[bh].lock);
+      bh = v;
+    } else if(v != h)
+      release(&bcache.bucket[v].lock);
+  }
+  if(best == 0){
+    if(ahead){
+      release(&bcache.bucket[h].lock);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    panic("bget: no buffers");
+  }
+
+  b = best;
+  if(bh != h){
+    bunlink(b);
+    bpush(h, b);
+    release(&bcache.bucket[bh].lock);
   }
-  panic("bget: no buffers");
+  if(b->valid)
+    bcache.nevict++;
+
+found:
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  release(&bcache.bucket[h].lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
-// Return a locked buf with the contents of the indicated block.
+// Return a locked buf for the indicated block, having started
+// to read its contents if they are not cached. The caller must
+// bwait() for the read before using b->data.
 struct buf*
-bread(uint dev, uint blockno)
+bread_async(uint dev, uint blockno)
 {
   struct buf *b;
+  struct proc *p;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
+    if((p = myproc()) != 0)
+      p->ru.inblock++;
+    virtio_disk_start(&b, 1, 0);
   }
   return b;
 }
 
+// Return a locked buf with the contents of the indicated block.
+struct buf*
+bread(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bread_async(dev, blockno);
+  bwait(b);
+  return b;
+}
+
+// Wait for any read or write started on b to finish.
+// Must be locked.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  virtio_disk_wait(b);
+  b->valid = 1;
+}
+
+// Start reading the n blocks from blockno on into the cache,
+// those that are not there already, without waiting for the
+// reads to finish. Runs of uncached blocks are read with one
+// request each. The buffers stay locked until their reads are
+// done, so a bread() of one will wait.
+void
+breadahead(uint dev, uint blockno, int n)
+{
+  struct buf *b, *bs[MAXIOBLOCKS];
+  struct proc *p = myproc();
+  int i, m;
+
+  m = 0;
+  for(i = 0; i < n; i++){
+    if((b = bget(dev, blockno + i, 1)) != 0){
+      if(p != 0)
+        p->ru.inblock++;
+      b->async = 1;
+      bs[m++] = b;
+    }
+    if(m > 0 && (b == 0 || m == MAXIOBLOCKS || i == n-1)){
+      virtio_disk_start(bs, m, 0);
+      m = 0;
+    }
+  }
+}
+
+// Called by the disk driver, possibly from an interrupt,
+// when the read started by breadahead() has finished.
+// Does what brelse() would on behalf of the reader.
+void
+bdone(struct buf *b)
+{
+  uint h;
+
+  b->valid = 1;
+  b->async = 0;
+  releasesleep(&b->lock);
+
+  h = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
+  b->refcnt--;
+  if (b->refcnt == 0)
+    b->lastuse = ticks;
+  release(&bcache.bucket[h].lock);
+}
+
+// Start writing the contents of the n bufs in bs[], which hold
+// consecutive blocks, to disk as one request. They must be
+// locked, and stay so until bwait() says the write is done.
+// The writes are not charged to myproc(), which is usually a
+// log thread; log_write() charges the process that dirtied
+// the blocks.
+void
+bwritev_async(struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwrite");
+  virtio_disk_start(bs, n, 1);
+}
+
+// Start writing b's contents to disk.  Must be locked,
+// and stay so until bwait() says the write is done.
+void
+bwrite_async(struct buf *b)
+{
+  bwritev_async(&b, 1);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
-  if(!holdingsleep(&b->lock))
-    panic("bwrite");
-  virtio_disk_rw(b, 1);
+  bwrite_async(b);
+  bwait(b);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Note when it was last used, for eviction.
 void
 brelse(struct buf *b)
 {
+  uint h;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  h = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  uint h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  uint h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
+  release(&bcache.bucket[h].lock);
+}
+
+// Free up to BRECLAIM pages of unused buffers, for kalloc()
+// when it runs out of memory. Returns the number of pages freed.
+int
+breclaim(void)
+{
+  struct bchunk *c, **cp, *freed;
+  int i, n;
+
+  acquire(&bcache.lock);
+  for(i = 0; i < NBUCKET; i++)
+    acquire(&bcache.bucket[i].lock);
+
+  freed = 0;
+  n = 0;
+  for(cp = &bcache.chunks; (c = *cp) != 0 && n < BRECLAIM; ){
+    for(i = 0; i < BPERPAGE; i++)
+      if(c->buf[i].refcnt != 0)
+        break;
+    if(i < BPERPAGE){
+      cp = &c->next;
+      continue;
+    }
+    for(i = 0; i < BPERPAGE; i++)
+      bunlink(&c->buf[i]);
+    *cp = c->next;
+    c->next = freed;
+    freed = c;
+    bcache.nbuf -= BPERPAGE;
+    n++;
+  }
+
+  for(i = 0; i < NBUCKET; i++)
+    release(&bcache.bucket[i].lock);
   release(&bcache.lock);
+
+  while((c = freed) != 0){
+    freed = c->next;
+    kfree(c);
+  }
+  return n;
 }
 
+// Report the cache's size and hit/miss/eviction counts.
+void
+bstat(struct sysinfo *info)
+{
+  int i;
 
+  acquire(&bcache.lock);
+  info->nbuf = bcache.nbuf;
+  info->bmiss = bcache.nmiss;
+  info->bevict = bcache.nevict;
+  info->bhit = 0;
+  for(i = 0; i < NBUCKET; i++){
+    acquire(&bcache.bucket[i].lock);
+    info->bhit += bcache.bucket[i].nhit;
+    release(&bcache.bucket[i].lock);
+  }
+  release(&bcache.lock);
+}
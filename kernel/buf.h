@@ -1,11 +1,19 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // release when the disk is done (see bdone)
+  int qwrite;  // for the disk driver's queue of waiting requests:
+  int qn;      //   request length in blocks,
+  uint qtime;  //   ticks when queued,
+  struct buf *qnext; // next request in block order
+  struct buf *rnext; // next buf in the same disk request
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse; // ticks at last brelse(), for LRU eviction
+  uint logseq;  // last log transaction to log_write() it
+  struct buf *prev; // hash bucket list
   struct buf *next;
   uchar data[BSIZE];
 };
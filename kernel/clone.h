@@ -0,0 +1 @@
+#define CLONE_VM  0x001  // share the caller's address space
@@ -8,14 +8,23 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct sysinfo;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+struct buf*     bread_async(uint, uint);
+void            bwrite_async(struct buf*);
+void            bwritev_async(struct buf**, int);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             breclaim(void);
+void            breadahead(uint, uint, int);
+void            bdone(struct buf*);
+void            bstat(struct sysinfo*);
 
 // console.c
 void            consoleinit(void);
@@ -36,6 +45,8 @@ int             filewrite(struct file*, uint64, int n);
 
 // fs.c
 void            fsinit(int);
+void            fsstat(struct sysinfo*);
+void            dcache_set(struct inode*, char*, uint);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
@@ -53,14 +64,22 @@ int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+void            iblockmap(struct inode*);
+int             ireclaim(void);
 
 // ramdisk.c
 void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// futex.c
+void            futexinit(void);
+int             futex_wait(uint64, int);
+int             futex_wake(uint64, int);
+
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_noreclaim(void);
 void            kfree(void *);
 void            kinit(void);
 int             calfreemem(void);
@@ -68,7 +87,8 @@ int             calfreemem(void);
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
-void            begin_op(void);
+void            begin_op(int);
+int             log_maxop(int);
 void            end_op(void);
 
 // pipe.c
@@ -86,6 +106,10 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             clone(uint64, uint64, int, uint64);
+int             join(uint64);
+int             getrusage(int, uint64);
+void            kthread(void (*)(void), char*);
 int             growproc(int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -99,13 +123,14 @@ void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
-int             wait(uint64);
+int             wait(uint64, uint64);
 void            wakeup(void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 int             calfreeproc(void);
+int             procreclaim(void);
 
 
 // swtch.S
@@ -183,7 +208,9 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
+int             virtio_disk_poll(int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
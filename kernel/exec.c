@@ -3,8 +3,10 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "defs.h"
+#include "fs.h"
 #include "elf.h"
 
 static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
@@ -21,7 +23,11 @@ exec(char *path, char **argv)
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
-  begin_op();
+  // other threads would be left running in the old image.
+  if(p->thread || p->threadslots)
+    return -1;
+
+  begin_op(TRUNCBLOCKS);
 
   if((ip = namei(path)) == 0){
     end_op();
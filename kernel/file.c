@@ -11,6 +11,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "stat.h"
+#include "rusage.h"
 #include "proc.h"
 
 struct devsw devsw[NDEV];
@@ -81,7 +82,7 @@ void fileclose(struct file *f)
 	}
 	else if (ff.type == FD_INODE || ff.type == FD_DEVICE)
 	{
-		begin_op();
+		begin_op(TRUNCBLOCKS);
 		iput(ff.ip);
 		end_op();
 	}
@@ -161,13 +162,15 @@ int filewrite(struct file *f, uint64 addr, int n)
 	}
 	else if (f->type == FD_INODE)
 	{
-		// write a few blocks at a time to avoid exceeding
-		// the maximum log transaction size, including
-		// i-node, indirect block, allocation blocks,
-		// and 2 blocks of slop for non-aligned writes.
+		// write a chunk of blocks at a time to avoid exceeding
+		// the maximum log transaction size. each chunk reserves
+		// log space for its data blocks, a block of slop for
+		// non-aligned writes, the i-node, the indirect blocks
+		// on the way to two leaf indirect blocks, 2 allocation
+		// blocks and the superblock.
 		// this really belongs lower down, since writei()
 		// might be writing a device like the console.
-		int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
+		int max = (log_maxop(MAXWRITEBLOCKS) - 1 - 1 - (NLEVEL+1) - 2 - 1) * BSIZE;
 		int i = 0;
 		while (i < n)
 		{
@@ -175,7 +178,7 @@ int filewrite(struct file *f, uint64 addr, int n)
 			if (n1 > max)
 				n1 = max;
 
-			begin_op();
+			begin_op(n1 / BSIZE + 1 + 1 + (NLEVEL+1) + 2 + 1);
 			ilock(f->ip);
 			if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
 				f->off += r;
@@ -185,7 +188,7 @@ int filewrite(struct file *f, uint64 addr, int n)
 			if (r < 0)
 				break;
 			if (r != n1)
-				panic("short filewrite");
+				break; // error from writei
 			i += r;
 		}
 		ret = (i == n ? n : -1);
@@ -26,7 +26,16 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NADDR];
+
+  uint raoff;         // where the last readi() ended
+  uint raend;         // blocks before this have been read ahead
+  uint iblock;        // indirect block the last bmap() used, or 0
+  uint ibase;         // file block its first address is for
+
+  struct inode *hnext; // hash bucket list, guarded by the bucket's lock
+  struct inode *fprev; // free list, if ref is 0
+  struct inode *fnext;
 };
 
 // map major device number to device functions.
@@ -15,17 +15,71 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "sysinfo.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
 
+#define NBITMAP (FSSIZE/BPB + 1)
+
+// In-memory hints for balloc(). next is where the last
+// allocation left off, so that the search for a free block
+// picks up there; it is only a hint, and not locked. nfree[i]
+// counts the free bits in bitmap block i, or is -1 until that
+// block is first searched. It is only changed with the bitmap
+// block's buf locked, but balloc_range() reads it without the
+// lock to skip full blocks, so it may be stale there; balloc()
+// makes a last pass that ignores it before giving up.
+// sb.nfree is serialized by the superblock's buf (see bcount()).
+struct {
+  uint next;
+  int nfree[NBITMAP];
+} bhint;
+
+// Preallocation windows. When a file gets a data block, the
+// NPREALLOC blocks after it are set aside for the file's next
+// blocks, so that files written at the same time do not end up
+// interleaved. A window is only kept in memory: other files'
+// allocations step over it unless the disk is otherwise full.
+#define NRESV 16
+struct {
+  struct spinlock lock;
+  struct {
+    uint inum;        // owner, or 0 if the slot is free
+    uint start, end;  // blocks [start, end)
+    uint lastuse;     // ticks, to pick a window to replace
+  } w[NRESV];
+} bresv;
+
+// Directory name cache. Maps a name in directory dir to the
+// inum its entry holds, or to 0 if the directory has no such
+// entry, so that namex() need not read the directory. Entries
+// are looked up and changed only with dir's inode locked, which
+// keeps them in step with the directory's contents. The cache
+// is DWAYS-way set associative; a full set gives up its least
+// recently used entry.
+#define DWAYS 4
+#define NDSET (NDENTRY/DWAYS)
+struct {
+  struct spinlock lock;
+  struct {
+    uint dev;
+    uint dir;          // directory inum, or 0 if the slot is free
+    char name[DIRSIZ];
+    uint inum;         // 0 for a name known not to be there
+    uint lastuse;      // ticks
+  } e[NDSET][DWAYS];
+} dcache;
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -43,7 +97,17 @@ fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  if(sb.size > NBITMAP*BPB)
+    panic("fsinit: file system too big");
+  for(int i = 0; i < NBITMAP; i++)
+    bhint.nfree[i] = -1;
+  initlock(&bresv.lock, "bresv");
+  initlock(&dcache.lock, "dcache");
   initlog(dev, &sb);
+  // recovery may have installed a newer superblock, with the
+  // nfree of the last committed transaction; bcount() writes
+  // the whole of sb back, so it must not keep the stale copy.
+  readsb(dev, &sb);
 }
 
 // Zero a block.
@@ -60,28 +124,179 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Return the first clear bit in [lo, hi) of bitmap block
+// data, or -1. Skips a 64-bit word of used blocks at a time.
+static int
+bfirstfree(uchar *data, int lo, int hi)
+{
+  uint64 *w = (uint64 *) data;
+  uint64 x;
+  int bi;
+
+  for(bi = lo; bi < hi; bi = (bi/64 + 1) * 64){
+    x = ~w[bi/64] >> (bi % 64);
+    if(x == 0)
+      continue;
+    while((x & 1) == 0){
+      x >>= 1;
+      bi++;
+    }
+    return bi < hi ? bi : -1;
+  }
+  return -1;
+}
+
+// Count the clear bits in [0, hi) of bitmap block data.
+static int
+bcountfree(uchar *data, int hi)
+{
+  int bi, n;
+
+  n = 0;
+  for(bi = 0; bi < hi; bi++)
+    if((data[bi/8] & (1 << (bi % 8))) == 0)
+      n++;
+  return n;
+}
+
+// Add n to the free block count in the superblock.
+// The superblock's buf lock serializes the update.
+static void
+bcount(int dev, int n)
+{
+  struct buf *bp;
+
+  bp = bread(dev, 1);
+  sb.nfree += n;
+  memmove(bp->data, &sb, sizeof(sb));
+  log_write(bp);
+  brelse(bp);
+}
+
+// If block b is in a window set aside for a file other than
+// inum, return the end of the window, else 0.
+static uint
+bresv_other(uint b, uint inum)
+{
+  uint end;
+  int i;
+
+  end = 0;
+  acquire(&bresv.lock);
+  for(i = 0; i < NRESV; i++){
+    if(bresv.w[i].inum != 0 && bresv.w[i].inum != inum &&
+       bresv.w[i].start <= b && b < bresv.w[i].end){
+      end = bresv.w[i].end;
+      break;
+    }
+  }
+  release(&bresv.lock);
+  return end;
+}
+
+// Set aside the NPREALLOC blocks after b for file inum,
+// replacing its old window, or else the least recently used.
+static void
+bresv_set(uint b, uint inum)
+{
+  int i, w;
+
+  acquire(&bresv.lock);
+  for(w = 0; w < NRESV; w++)
+    if(bresv.w[w].inum == inum)
+      break;
+  if(w == NRESV){
+    w = 0;
+    for(i = 0; i < NRESV; i++){
+      if(bresv.w[i].inum == 0){
+        w = i;
+        break;
+      }
+      if(bresv.w[i].lastuse < bresv.w[w].lastuse)
+        w = i;
+    }
+  }
+  bresv.w[w].inum = inum;
+  bresv.w[w].start = b + 1;
+  bresv.w[w].end = min(b + 1 + NPREALLOC, sb.size);
+  bresv.w[w].lastuse = ticks;
+  release(&bresv.lock);
+}
+
+// Give back file inum's window, if it has one.
+static void
+bresv_drop(uint inum)
+{
+  int i;
+
+  acquire(&bresv.lock);
+  for(i = 0; i < NRESV; i++)
+    if(bresv.w[i].inum == inum)
+      bresv.w[i].inum = 0;
+  release(&bresv.lock);
+}
+
+// Allocate the first free block in [lo, hi), or return 0.
+// If any is 0, skip blocks set aside for files other than inum.
+// If any is 2, also search bitmap blocks whose nfree hint says
+// they are full, and recount them with their buf locked.
 static uint
-balloc(uint dev)
+balloc_range(uint dev, uint lo, uint hi, uint inum, int any)
 {
-  int b, bi, m;
+  uint b, blo, bhi, end;
+  int bi, k;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
+  for(b = lo - lo % BPB; b < hi; b += BPB){
+    k = b / BPB;
+    if(bhint.nfree[k] == 0 && any < 2)
+      continue;
+    blo = b < lo ? lo - b : 0;
+    bhi = min(hi - b, BPB);
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+    if(bhint.nfree[k] < 0 || any == 2)
+      bhint.nfree[k] = bcountfree(bp->data, min(sb.size - b, BPB));
+    while((bi = bfirstfree(bp->data, blo, bhi)) >= 0){
+      if(!any && (end = bresv_other(b + bi, inum)) != 0){
+        blo = end - b;
+        continue;
       }
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      log_write(bp);
+      bhint.nfree[k]--;
+      bcount(dev, -1);
+      brelse(bp);
+      bzero(dev, b + bi);
+      bhint.next = b + bi + 1;
+      return b + bi;
     }
     brelse(bp);
   }
+  return 0;
+}
+
+// Allocate a zeroed disk block for file inum, or for file
+// system metadata if inum is 0. The search starts at goal,
+// if it is not 0, or else where the last one left off, and
+// wraps around. If that finds nothing, it searches again over
+// other files' windows, and then over every bitmap block.
+static uint
+balloc(uint dev, uint goal, uint inum)
+{
+  uint b, start;
+  int any;
+
+  start = goal ? goal : bhint.next;
+  if(start >= sb.size)
+    start = 0;
+  for(any = 0; any < 3; any++){
+    if((b = balloc_range(dev, start, sb.size, inum, any)) != 0 ||
+       (b = balloc_range(dev, 0, start, inum, any)) != 0){
+      if(inum)
+        bresv_set(b, inum);
+      return b;
+    }
+  }
   panic("balloc: out of blocks");
 }
 
@@ -99,9 +314,19 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  if(bhint.nfree[b / BPB] >= 0)
+    bhint.nfree[b / BPB]++;
+  bcount(dev, 1);
   brelse(bp);
 }
 
+// Report the number of free disk blocks.
+void
+fsstat(struct sysinfo *info)
+{
+  info->nfreeblk = sb.nfree;
+}
+
 // Inodes.
 //
 // An inode describes a single unnamed file.
@@ -162,32 +387,125 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// The cached inodes are spread over NIBUCKET hash buckets by
+// (dev, inum), each with its own spin-lock, so that lookups of
+// different inodes do not contend. A bucket's lock protects
+// ip->ref, ip->dev, and ip->inum of the inodes in it, so one
+// must hold it while using any of those fields.
+//
+// Entries whose ref has fallen to zero stay in their bucket,
+// still valid, and are also kept on a free list in the order
+// they were released. iget() recycles the least recently
+// released one when it misses, and takes a fresh page of
+// entries from kalloc() when none is free; ireclaim() gives
+// such pages back when kalloc() runs short. icache.lock allows
+// only one miss at a time, and icache.freelock, the innermost
+// of these locks, guards the free list.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum, and the list links.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 31
+#define IPERPAGE 20  // inodes carved from each kalloc'd page
+
+// Inodes beyond the first NINODE live in pages from kalloc().
+struct ichunk {
+  struct inode inode[IPERPAGE];
+  struct ichunk *next;
+};
+
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+  struct ichunk *chunks; // pages of extra inodes
+  int ninode;            // total inodes, including inode[]
+
+  struct spinlock freelock;
+  struct inode free;     // head of free list, through fprev/fnext;
+                         // least recently released first
+
+  // Each bucket has a linked list of its inodes, through hnext.
+  struct {
+    struct spinlock lock;
+    struct inode *head;
+  } bucket[NIBUCKET];
 } icache;
 
+static uint
+ihash(uint dev, uint inum)
+{
+  return (dev + inum) % NIBUCKET;
+}
+
+// Add ip to bucket h.
+// Caller must hold that bucket's lock.
+static void
+ipush(uint h, struct inode *ip)
+{
+  ip->hnext = icache.bucket[h].head;
+  icache.bucket[h].head = ip;
+}
+
+// Remove ip from bucket h.
+// Caller must hold that bucket's lock.
+static void
+iunhash(uint h, struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &icache.bucket[h].head; *pp != ip; pp = &(*pp)->hnext)
+    if(*pp == 0)
+      panic("iunhash");
+  *pp = ip->hnext;
+}
+
+// Append ip to the free list, as the most recently released.
+static void
+ifreelist_put(struct inode *ip)
+{
+  acquire(&icache.freelock);
+  ip->fnext = &icache.free;
+  ip->fprev = icache.free.fprev;
+  icache.free.fprev->fnext = ip;
+  icache.free.fprev = ip;
+  release(&icache.freelock);
+}
+
+// Take ip off the free list.
+static void
+ifreelist_del(struct inode *ip)
+{
+  acquire(&icache.freelock);
+  ip->fnext->fprev = ip->fprev;
+  ip->fprev->fnext = ip->fnext;
+  ip->fnext = ip->fprev = 0;
+  release(&icache.freelock);
+}
+
 void
 iinit()
 {
   int i = 0;
   
+  if(sizeof(struct ichunk) > PGSIZE)
+    panic("iinit: ichunk");
+
   initlock(&icache.lock, "icache");
+  initlock(&icache.freelock, "icache.free");
+  icache.free.fnext = icache.free.fprev = &icache.free;
+  for(i = 0; i < NIBUCKET; i++)
+    initlock(&icache.bucket[i].lock, "icache.bucket");
+
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&icache.inode[i].lock, "inode");
+    ifreelist_put(&icache.inode[i]);
   }
+  icache.ninode = NINODE;
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void dcache_purge(uint dev, uint dir);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -205,6 +523,8 @@ ialloc(uint dev, short type)
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
+      if(type == T_FILE && FSEXTENTS)
+        dip->addrs[0] = EXTMAGIC;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
       return iget(dev, inum);
@@ -236,37 +556,178 @@ iupdate(struct inode *ip)
   brelse(bp);
 }
 
+// Add page c of fresh inodes to the cache, put all but one
+// of them on the free list, and return that one.
+// Caller must hold icache.lock.
+static struct inode*
+igrow(struct ichunk *c)
+{
+  int i;
+
+  memset(c, 0, sizeof(*c));
+  for(i = 0; i < IPERPAGE; i++){
+    initsleeplock(&c->inode[i].lock, "inode");
+    if(i > 0)
+      ifreelist_put(&c->inode[i]);
+  }
+  c->next = icache.chunks;
+  icache.chunks = c;
+  icache.ninode += IPERPAGE;
+  return &c->inode[0];
+}
+
+// Free the pages of inodes that are all unreferenced, for
+// kalloc() when it runs out of memory. Returns the number of
+// pages freed.
+int
+ireclaim(void)
+{
+  struct ichunk *c, **cp, *freed;
+  struct inode *ip;
+  int i, n;
+
+  acquire(&icache.lock);
+  for(i = 0; i < NIBUCKET; i++)
+    acquire(&icache.bucket[i].lock);
+
+  freed = 0;
+  n = 0;
+  for(cp = &icache.chunks; (c = *cp) != 0; ){
+    for(i = 0; i < IPERPAGE; i++)
+      if(c->inode[i].ref != 0)
+        break;
+    if(i < IPERPAGE){
+      cp = &c->next;
+      continue;
+    }
+    // all are on the free list; the used ones are hashed too.
+    for(i = 0; i < IPERPAGE; i++){
+      ip = &c->inode[i];
+      if(ip->inum != 0)
+        iunhash(ihash(ip->dev, ip->inum), ip);
+      ifreelist_del(ip);
+    }
+    *cp = c->next;
+    c->next = freed;
+    freed = c;
+    icache.ninode -= IPERPAGE;
+    n++;
+  }
+
+  for(i = 0; i < NIBUCKET; i++)
+    release(&icache.bucket[i].lock);
+  release(&icache.lock);
+
+  while((c = freed) != 0){
+    freed = c->next;
+    kfree(c);
+  }
+  return n;
+}
+
+// Look for inode inum on device dev in bucket h and, if it is
+// there, take a reference to it.
+// Caller must hold that bucket's lock.
+static struct inode*
+ilookup(uint h, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = icache.bucket[h].head; ip != 0; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        ifreelist_del(ip);
+      return ip;
+    }
+  }
+  return 0;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, *np;
+  struct ichunk *c;
+  uint h = ihash(dev, inum);
+  uint oh;
+
+  acquire(&icache.bucket[h].lock);
+  if((ip = ilookup(h, dev, inum)) != 0){
+    release(&icache.bucket[h].lock);
+    return ip;
+  }
+  release(&icache.bucket[h].lock);
 
+  // Not cached. Only one miss at a time, so that holding our
+  // bucket's lock while taking another's cannot deadlock, and
+  // so that the dev and inum of free entries stay put.
   acquire(&icache.lock);
+  acquire(&icache.bucket[h].lock);
 
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  // Someone else may have cached it while we were unlocked.
+  if((ip = ilookup(h, dev, inum)) != 0){
+    release(&icache.bucket[h].lock);
+    release(&icache.lock);
+    return ip;
+  }
+
+  // Recycle the least recently released inode. An iget() hit
+  // may take it off the free list until we hold its bucket's
+  // lock, so check again then. Entries that have never been
+  // used have inum 0 and are in no bucket.
+  for(;;){
+    acquire(&icache.freelock);
+    ip = icache.free.fnext;
+    release(&icache.freelock);
+    if(ip == &icache.free){
+      // None is free. kalloc() may call ireclaim() or
+      // breclaim(), so take a page without holding any of
+      // our locks, and look again once they are back.
+      release(&icache.bucket[h].lock);
       release(&icache.lock);
-      return ip;
+      if((c = (struct ichunk*)kalloc()) == 0)
+        panic("iget: no inodes");
+      acquire(&icache.lock);
+      acquire(&icache.bucket[h].lock);
+      ip = igrow(c);
+      if((np = ilookup(h, dev, inum)) != 0){
+        ifreelist_put(ip);
+        release(&icache.bucket[h].lock);
+        release(&icache.lock);
+        return np;
+      }
+      break;
+    }
+    if(ip->inum == 0){
+      ifreelist_del(ip);
+      break;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+    oh = ihash(ip->dev, ip->inum);
+    if(oh != h)
+      acquire(&icache.bucket[oh].lock);
+    if(ip->ref == 0){
+      ifreelist_del(ip);
+      iunhash(oh, ip);
+      if(oh != h)
+        release(&icache.bucket[oh].lock);
+      break;
+    }
+    if(oh != h)
+      release(&icache.bucket[oh].lock);
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->raoff = 0;
+  ip->raend = 0;
+  ip->iblock = 0;
+  ipush(h, ip);
+  release(&icache.bucket[h].lock);
   release(&icache.lock);
 
   return ip;
@@ -277,9 +738,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
+  uint h = ihash(ip->dev, ip->inum);
+
+  acquire(&icache.bucket[h].lock);
   ip->ref++;
-  release(&icache.lock);
+  release(&icache.bucket[h].lock);
   return ip;
 }
 
@@ -332,7 +795,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&icache.lock);
+  uint h = ihash(ip->dev, ip->inum);
+
+  acquire(&icache.bucket[h].lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -341,8 +806,10 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&icache.lock);
+    release(&icache.bucket[h].lock);
 
+    if(ip->type == T_DIR)
+      dcache_purge(ip->dev, ip->inum);  // before inum is reused
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -350,11 +817,14 @@ iput(struct inode *ip)
 
     releasesleep(&ip->lock);
 
-    acquire(&icache.lock);
+    acquire(&icache.bucket[h].lock);
   }
 
-  ip->ref--;
-  release(&icache.lock);
+  if(ip->ref == 1)
+    bresv_drop(ip->inum);  // no one is left to write it
+  if(--ip->ref == 0)
+    ifreelist_put(ip);
+  release(&icache.bucket[h].lock);
 }
 
 // Common idiom: unlock, then put.
@@ -370,38 +840,195 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT], the next NINDIRECT^2
+// in the blocks listed in block ip->addrs[NDIRECT+1], and the
+// next NINDIRECT^3 a level further down from ip->addrs[NDIRECT+2].
+//
+// Regular files use extents instead (see EXTMAGIC in fs.h),
+// so that finding a block of a contiguous file takes no disk
+// reads. Files only grow at the end, so extents cover the
+// file's blocks in order and the first block of extent i is
+// the total length of extents 0..i-1.
+
+// Extent i of extent inode ip. Extents past the ones in the
+// inode are in the extent block, which is read into *bpp the
+// first time it is needed; the caller must brelse() it.
+static struct extent*
+extent(struct inode *ip, uint i, struct buf **bpp)
+{
+  if(i < NIEXTENT)
+    return (struct extent*)&ip->addrs[2] + i;
+  if(*bpp == 0)
+    *bpp = bread(ip->dev, ip->addrs[NADDR-1]);
+  return (struct extent*)(*bpp)->data + (i - NIEXTENT);
+}
+
+// bmap() for an extent inode. Only the block just past the
+// last extent can be allocated; return 0 for any block further
+// out, or when the inode has no room for another extent.
+static uint
+ebmap(struct inode *ip, uint bn)
+{
+  struct buf *bp;
+  struct extent *e;
+  uint i, n, off, addr, goal;
+
+  bp = 0;
+  n = ip->addrs[1];
+  off = 0;
+  for(i = 0; i < n; i++){
+    e = extent(ip, i, &bp);
+    if(bn < off + e->len){
+      addr = e->start + (bn - off);
+      goto out;
+    }
+    off += e->len;
+  }
+  addr = 0;
+  if(bn != off)
+    goto out;
+
+  // grow the last extent if the block after it is free,
+  // else start a new one.
+  e = n > 0 ? extent(ip, n-1, &bp) : 0;
+  goal = e ? e->start + e->len : 0;
+  addr = balloc(ip->dev, goal, ip->inum);
+  if(e && addr == goal){
+    e->len++;
+    i = n - 1;
+  } else if(n < MAXEXTENT){
+    if(n == NIEXTENT)
+      ip->addrs[NADDR-1] = balloc(ip->dev, 0, 0);
+    e = extent(ip, n, &bp);
+    e->start = addr;
+    e->len = 1;
+    ip->addrs[1] = ++n;
+    i = n - 1;
+  } else {
+    bfree(ip->dev, addr);
+    addr = 0;
+    goto out;
+  }
+  if(i >= NIEXTENT)
+    log_write(bp);
+
+out:
+  if(bp)
+    brelse(bp);
+  return addr;
+}
+
+// Free all of extent inode ip's blocks.
+static void
+etrunc(struct inode *ip)
+{
+  struct buf *bp;
+  struct extent *e;
+  uint i, j;
+
+  bp = 0;
+  for(i = 0; i < ip->addrs[1]; i++){
+    e = extent(ip, i, &bp);
+    for(j = 0; j < e->len; j++)
+      bfree(ip->dev, e->start + j);
+  }
+  if(bp)
+    brelse(bp);
+  if(ip->addrs[1] > NIEXTENT)
+    bfree(ip->dev, ip->addrs[NADDR-1]);
+  memset(&ip->addrs[1], 0, sizeof(ip->addrs) - sizeof(ip->addrs[0]));
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
+// Return 0 if the file can have no nth block.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
+  uint addr, *a, goal, prev, fbn, i;
+  uint64 n, div;
   struct buf *bp;
+  int level;
 
+  if(ip->addrs[0] == EXTMAGIC)
+    return ebmap(ip, bn);
+
+  // New data blocks go right after the file's previous
+  // block where they can, so files end up contiguous.
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+    if((addr = ip->addrs[bn]) == 0){
+      goal = bn > 0 && ip->addrs[bn-1] ? ip->addrs[bn-1] + 1 : 0;
+      ip->addrs[bn] = addr = balloc(ip->dev, goal, ip->inum);
+    }
     return addr;
   }
+  fbn = bn;
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+  // Which of the single, double and triple indirect blocks?
+  // One of level l leads to NINDIRECT^l data blocks.
+  for(level = 1, n = NINDIRECT; level <= NLEVEL; level++, n *= NINDIRECT){
+    if(bn < n)
+      break;
+    bn -= n;
+  }
+  if(level > NLEVEL)
+    return 0;
+
+  // Find the indirect block holding bn's address, allocating
+  // if necessary, unless it is the one the last call used.
+  if(ip->iblock != 0 && fbn - ip->ibase < NINDIRECT){
+    addr = ip->iblock;
+  } else {
+    if((addr = ip->addrs[NDIRECT+level-1]) == 0)
+      ip->addrs[NDIRECT+level-1] = addr = balloc(ip->dev, 0, 0);
+    for(div = n / NINDIRECT; div > 1; div /= NINDIRECT){
+      bp = bread(ip->dev, addr);
+      a = (uint*)bp->data;
+      i = bn / div % NINDIRECT;
+      if((addr = a[i]) == 0){
+        a[i] = addr = balloc(ip->dev, 0, 0);
+        log_write(bp);
+      }
+      brelse(bp);
     }
-    brelse(bp);
-    return addr;
+    ip->iblock = addr;
+    ip->ibase = fbn - bn % NINDIRECT;
   }
 
-  panic("bmap: out of range");
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  i = bn % NINDIRECT;
+  if((addr = a[i]) == 0){
+    prev = i > 0 ? a[i-1] : level == 1 ? ip->addrs[NDIRECT-1] : 0;
+    a[i] = addr = balloc(ip->dev, prev ? prev + 1 : 0, ip->inum);
+    log_write(bp);
+  }
+  brelse(bp);
+  return addr;
+}
+
+// Free indirect block addr, of the given level, and all
+// the blocks under it.
+static void
+ifree(uint dev, uint addr, int level)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(level > 1)
+      ifree(dev, a[j], level - 1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
 }
 
 // Truncate inode (discard contents).
@@ -409,9 +1036,12 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  if(ip->addrs[0] == EXTMAGIC){
+    etrunc(ip);
+    goto out;
+  }
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -420,20 +1050,31 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < NLEVEL; i++){
+    if(ip->addrs[NDIRECT+i]){
+      ifree(ip->dev, ip->addrs[NDIRECT+i], i + 1);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
+  ip->iblock = 0;
 
+out:
   ip->size = 0;
   iupdate(ip);
+  bresv_drop(ip->inum);
+}
+
+// Make ip, a locked empty regular file, map its blocks with
+// direct and indirect blocks rather than extents, whatever
+// FSEXTENTS says; for open()'s O_NOEXTENT.
+void
+iblockmap(struct inode *ip)
+{
+  if(ip->type != T_FILE || ip->size != 0 || ip->addrs[0] != EXTMAGIC)
+    return;
+  itrunc(ip);  // the extent block, if it has one
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  iupdate(ip);
 }
 
 // Copy stat information from inode.
@@ -448,6 +1089,27 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Start reading the blocks after bn, up to NREADAHEAD
+// of them, that a sequential reader of ip will want next.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint b, n, addr, end, nblocks;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  end = min(bn + 1 + NREADAHEAD, nblocks);
+  for(b = max(bn + 1, ip->raend); b < end; b += n){
+    // read runs of blocks that are adjacent on disk together.
+    addr = bmap(ip, b);
+    for(n = 1; b + n < end && bmap(ip, b + n) == addr + n; n++)
+      ;
+    breadahead(ip->dev, addr, n);
+  }
+  if(end > ip->raend)
+    ip->raend = end;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -456,6 +1118,7 @@ int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
+  int seq;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -463,7 +1126,15 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  // a read that starts where the last one ended is
+  // probably streaming through the file.
+  seq = (off == ip->raoff);
+  if(!seq)
+    ip->raend = 0;
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    if(seq)
+      readahead(ip, off/BSIZE);
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
@@ -472,6 +1143,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     }
     brelse(bp);
   }
+  ip->raoff = off;
   return tot;
 }
 
@@ -482,16 +1154,18 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(ip->addrs[0] != EXTMAGIC && off + n > MAXFILE*BSIZE)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if((addr = bmap(ip, off/BSIZE)) == 0)
+      break;
+    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
@@ -510,7 +1184,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     iupdate(ip);
   }
 
-  return n;
+  return tot;
 }
 
 // Directories
@@ -521,8 +1195,90 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+static uint
+dhash(uint dev, uint dir, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dir;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDSET;
+}
+
+// Look for name in directory dp in the name cache. If it is
+// there, set *inum to what the entry holds and return 1.
+// Caller must hold dp->lock.
+static int
+dcache_get(struct inode *dp, char *name, uint *inum)
+{
+  uint h = dhash(dp->dev, dp->inum, name);
+  int i;
+
+  acquire(&dcache.lock);
+  for(i = 0; i < DWAYS; i++){
+    if(dcache.e[h][i].dir == dp->inum && dcache.e[h][i].dev == dp->dev &&
+       namecmp(dcache.e[h][i].name, name) == 0){
+      dcache.e[h][i].lastuse = ticks;
+      *inum = dcache.e[h][i].inum;
+      release(&dcache.lock);
+      return 1;
+    }
+  }
+  release(&dcache.lock);
+  return 0;
+}
+
+// Record that name in directory dp now refers to inum, or that
+// it is not there if inum is 0.
+// Caller must hold dp->lock.
+void
+dcache_set(struct inode *dp, char *name, uint inum)
+{
+  uint h = dhash(dp->dev, dp->inum, name);
+  int i, w;
+
+  acquire(&dcache.lock);
+  w = 0;
+  for(i = 0; i < DWAYS; i++){
+    if(dcache.e[h][i].dir == dp->inum && dcache.e[h][i].dev == dp->dev &&
+       namecmp(dcache.e[h][i].name, name) == 0){
+      w = i;
+      break;
+    }
+    if(dcache.e[h][i].dir == 0)
+      w = i;
+    else if(dcache.e[h][w].dir != 0 &&
+            dcache.e[h][i].lastuse < dcache.e[h][w].lastuse)
+      w = i;
+  }
+  dcache.e[h][w].dev = dp->dev;
+  dcache.e[h][w].dir = dp->inum;
+  strncpy(dcache.e[h][w].name, name, DIRSIZ);
+  dcache.e[h][w].inum = inum;
+  dcache.e[h][w].lastuse = ticks;
+  release(&dcache.lock);
+}
+
+// Forget all names in directory dir, which is being freed.
+static void
+dcache_purge(uint dev, uint dir)
+{
+  int h, i;
+
+  acquire(&dcache.lock);
+  for(h = 0; h < NDSET; h++)
+    for(i = 0; i < DWAYS; i++)
+      if(dcache.e[h][i].dir == dir && dcache.e[h][i].dev == dev)
+        dcache.e[h][i].dir = 0;
+  release(&dcache.lock);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Lookups that do not need the offset try the name cache
+// first, and fill it in from the directory if they miss.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
@@ -532,6 +1288,9 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(poff == 0 && dcache_get(dp, name, &inum))
+    return inum ? iget(dp->dev, inum) : 0;
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -542,10 +1301,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcache_set(dp, name, inum);
       return iget(dp->dev, inum);
     }
   }
 
+  dcache_set(dp, name, 0);
   return 0;
 }
 
@@ -575,6 +1336,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcache_set(dp, name, inum);
 
   return 0;
 }
@@ -20,13 +20,44 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint nfree;        // Number of free blocks
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+// Log blocks an FS operation reserves with begin_op(): the most
+// distinct blocks it can write.
+#define TRUNCBLOCKS  (1 + FSSIZE/BPB + 1 + 1)  // free a file: inode,
+                                               // bitmap, superblock
+#define LINKBLOCKS   8  // add a dir entry: entry, NLEVEL indirect,
+                        // bitmap, superblock, dir inode, target inode
+#define CREATEBLOCKS (LINKBLOCKS + 3)  // + a new dir's first block, its
+                                       // bitmap block, parent inode
+#define UNLINKBLOCKS (2 + TRUNCBLOCKS) // entry, parent inode, free target
+// The biggest of them, open(O_CREATE|O_TRUNC)'s, which the log
+// must be able to hold (see initlog()).
+#define MAXOPRESERVE (CREATEBLOCKS + TRUNCBLOCKS)
+
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NLEVEL 3  // single, double and triple indirect blocks
+#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT + \
+                 NINDIRECT*NINDIRECT*NINDIRECT)
+#define NADDR (NDIRECT+NLEVEL)
+
+// An inode whose addrs[0] is EXTMAGIC maps its data with
+// extents, runs of consecutive blocks, instead: addrs[1] is
+// the number of extents, the first NIEXTENT of them are in
+// addrs[2..], and the rest in the block addrs[NADDR-1].
+#define EXTMAGIC 0xe7e7e7e7
+#define NIEXTENT ((NADDR - 3) / 2)
+#define NBEXTENT (BSIZE / sizeof(struct extent))
+#define MAXEXTENT (NIEXTENT + NBEXTENT)
+
+struct extent {
+  uint start;           // first block
+  uint len;             // number of blocks
+};
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +66,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NADDR];    // Data block addresses, or extents
 };
 
 // Inodes per block.
@@ -0,0 +1,126 @@
+// Futexes: blocking for user-space locks, so that they
+// only need to enter the kernel under contention.
+//
+// futex_wait(addr, val) sleeps if the int at user address
+// addr still holds val; futex_wake(addr, n) wakes up to n
+// of the processes sleeping on addr. Waiters are keyed by
+// the physical address of the int, so threads sharing a
+// page table all meet on the same key.
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "rusage.h"
+#include "proc.h"
+
+#define NFUTEXQ 64
+
+// A sleeping futex_wait(), on its caller's kernel stack.
+struct futexw {
+  uint64 key;          // physical address waited on
+  int woken;           // set by futex_wake()
+  struct futexw *next;
+};
+
+struct futexq {
+  struct spinlock lock;
+  struct futexw *head;
+} futexq[NFUTEXQ];
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEXQ; i++)
+    initlock(&futexq[i].lock, "futex");
+}
+
+// Translate user address addr to a futex key, or 0
+// if it isn't a mapped, aligned int.
+static uint64
+futexkey(uint64 addr)
+{
+  uint64 pa;
+
+  if(addr % sizeof(int) != 0)
+    return 0;
+  if((pa = walkaddr(myproc()->pagetable, PGROUNDDOWN(addr))) == 0)
+    return 0;
+  return pa + (addr % PGSIZE);
+}
+
+static struct futexq*
+futexqof(uint64 key)
+{
+  return &futexq[(key >> 2) % NFUTEXQ];
+}
+
+// Sleep until woken by futex_wake(), if *addr == val.
+// Returns 0 if woken, -1 if *addr != val, addr is bad,
+// or we were killed.
+int
+futex_wait(uint64 addr, int val)
+{
+  struct proc *p = myproc();
+  struct futexw w, **wp;
+  struct futexq *q;
+
+  if((w.key = futexkey(addr)) == 0)
+    return -1;
+  q = futexqof(w.key);
+
+  // check *addr and queue up under q->lock, so that a
+  // futex_wake() following a store to *addr can't be missed.
+  acquire(&q->lock);
+  if(__atomic_load_n((int*)w.key, __ATOMIC_SEQ_CST) != val){
+    release(&q->lock);
+    return -1;
+  }
+  w.woken = 0;
+  w.next = q->head;
+  q->head = &w;
+
+  while(!w.woken && !p->killed)
+    sleep(&w, &q->lock);
+
+  if(!w.woken){
+    for(wp = &q->head; *wp != &w; wp = &(*wp)->next)
+      ;
+    *wp = w.next;
+  }
+  release(&q->lock);
+
+  return w.woken ? 0 : -1;
+}
+
+// Wake up to n processes waiting on addr.
+// Returns the number woken, or -1 if addr is bad.
+int
+futex_wake(uint64 addr, int n)
+{
+  struct futexw *w, **wp;
+  struct futexq *q;
+  uint64 key;
+  int woken;
+
+  if((key = futexkey(addr)) == 0)
+    return -1;
+  q = futexqof(key);
+
+  woken = 0;
+  acquire(&q->lock);
+  for(wp = &q->head; (w = *wp) != 0 && woken < n; ){
+    if(w->key != key){
+      wp = &w->next;
+      continue;
+    }
+    *wp = w->next;
+    w->woken = 1;
+    wakeup(w);
+    woken++;
+  }
+  release(&q->lock);
+
+  return woken;
+}
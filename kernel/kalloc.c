@@ -23,6 +23,7 @@ struct
 {
 	struct spinlock lock;
 	struct run *freelist;
+	int nfree; // pages on freelist
 } kmem;
 
 void kinit()
@@ -58,37 +59,63 @@ void kfree(void *pa)
 	acquire(&kmem.lock);
 	r->next = kmem.freelist;
 	kmem.freelist = r;
+	kmem.nfree++;
 	release(&kmem.lock);
 }
 
-// Allocate one 4096-byte page of physical memory.
-// Returns a pointer that the kernel can use.
-// Returns 0 if the memory cannot be allocated.
-void *kalloc(void)
+static void *
+kalloc1(int reclaim)
 {
 	struct run *r;
+	int tries;
 
-	acquire(&kmem.lock);
-	r = kmem.freelist;
-	if (r)
-		kmem.freelist = r->next;
-	release(&kmem.lock);
+	for (tries = 0;; tries++)
+	{
+		acquire(&kmem.lock);
+		r = kmem.freelist;
+		if (r)
+		{
+			kmem.freelist = r->next;
+			kmem.nfree--;
+		}
+		release(&kmem.lock);
+		if (r || !reclaim || tries > 0 ||
+			breclaim() + procreclaim() + ireclaim() == 0)
+			break;
+	}
 
 	if (r)
 		memset((char *)r, 5, PGSIZE); // fill with junk
 	return (void *)r;
 }
 
+// Allocate one 4096-byte page of physical memory.
+// Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+// When memory runs out, asks the buffer cache, the proc
+// table and the inode cache to give some back before failing.
+// Those take their own locks, so the caller must not hold
+// bcache, icache or ptable locks.
+void *kalloc(void)
+{
+	return kalloc1(1);
+}
+
+// Like kalloc(), but fail rather than reclaim; for callers
+// that hold locks the reclaimers take.
+void *kalloc_noreclaim(void)
+{
+	return kalloc1(0);
+}
+
 
+// Amount of free memory, in bytes.
 int calfreemem(void)
 {
-	int freepagenum = 0;
-	struct run *firstr_keep = kmem.freelist;
-	while(kmem.freelist)
-	{
-		freepagenum++;
-		kmem.freelist = kmem.freelist->next;
-	}
-	kmem.freelist = firstr_keep;
+	int freepagenum;
+
+	acquire(&kmem.lock);
+	freepagenum = kmem.nfree;
+	release(&kmem.lock);
 	return freepagenum*PGSIZE;
 }
\ No newline at end of file
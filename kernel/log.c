@@ -6,134 +6,376 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "rusage.h"
+#include "proc.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction is only closed when there are no FS
+// system calls active in it. Thus there is never any reasoning
+// required about whether a commit might write an uncommitted
+// system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. begin_op() is told the most blocks the
+// call can write, and usually just reserves that much log
+// space and returns. But if the log is close to running out,
+// it sleeps until the current transaction has been closed,
+// or until old transactions have been installed.
+//
+// Commits are done by a kernel thread, committer(), so end_op()
+// does not wait for the disk. It groups the operations of up to
+// COMMITTICKS ticks, or as many as fit in the log, into one
+// transaction. To close a transaction it copies the transaction's
+// blocks into snap[]; new operations can start as soon as that is
+// done, while the snapshot is appended to the log.
+//
+// A committed transaction's blocks stay pinned in the buffer
+// cache, and a second kernel thread, flusher(), installs them
+// later: when the log is half full, when begin_op() needs the
+// space, or after CKPTTICKS. A block that a later transaction
+// has logged again is left to that transaction's install.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
+//   log super block, with the position and sequence number
+//     of the oldest transaction not yet installed
+//   ring of transactions, each of them:
+//     header block, containing a checksum, a sequence number
+//       and block #s for block A, B, C, ...
+//     block A
+//     block B
+//     block C
+//     ...
+// A transaction may wrap around the end of the ring. The
+// checksum covers the rest of the header and blocks A, B, C,
+// ..., so the header and blocks are written together, in one
+// request where they fit, and the transaction has committed
+// once all of them are on disk. Recovery installs transactions
+// from the one in the log super block for as long as their
+// sequence numbers follow on and their checksums match.
+
+#define COMMITTICKS 1  // max age of an open transaction, in ticks
+#define CKPTTICKS  30  // max age of an uninstalled transaction, in ticks
+#define NLOGIO 8       // max blocks per recovery write
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
+  uint cksum;  // of the rest of the header and the logged blocks
+  uint seq;    // transactions are numbered as they commit
   int n;
   int block[LOGSIZE];
 };
 
+// Contents of the log super block.
+struct logsuper {
+  uint tail;   // ring position of the oldest transaction to install
+  uint seq;    // its sequence number
+};
+
+// Positions in the ring count up forever; block pos of the
+// ring is pos % log.nring.
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // log blocks, super block included; from the superblock
+  int nring;       // blocks in the ring
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they have reserved.
+  int committing;  // committer() is taking a snapshot, please wait.
+  int closing;     // transaction is due; no new ops, please wait.
+  uint opened;     // ticks when lh's first block was logged.
   int dev;
-  struct logheader lh;
+  uint seq;        // sequence number of the open transaction
+  uint done;       // transactions before seq done have committed
+  uint head;       // where the next transaction goes in the ring
+  uint committed;  // end of the last committed transaction
+  uint tail;       // start of the oldest transaction not installed
+  int ckwant;      // begin_op() is waiting for flusher()
+  uint ckticks;    // ticks when flusher() last installed
+  struct logheader lh; // the open transaction
 };
 struct log log;
 
+// What is at each block of the ring, for flusher(): for a
+// header, the transaction's sequence number and length; for a
+// logged block, the cache buf it is a copy of.
+struct ringent {
+  uint seq;
+  int n;
+  struct buf *b;
+};
+static struct ringent ring[LOGSIZE];
+
+// committer()'s copy of the transaction it is writing, and the
+// contents of its blocks as of the commit.
+// lbufs[] is the header block followed by the snapshot, which
+// is the order they sit in the log.
+static struct logheader clh;
+static struct buf snap[LOGSIZE];
+static struct buf hbuf;
+static struct buf *lbufs[1+LOGSIZE];
+
+// flusher()'s copies of the blocks it is installing, and of
+// the log super block.
+static struct buf ckpt[MAXIOBLOCKS];
+static struct buf *ckbufs[MAXIOBLOCKS];
+static struct buf sbuf;
+
 static void recover_from_log(void);
-static void commit();
+static void committer(void);
+static void flusher(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
+  int i;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
+  if (sb->nlog - 1 > LOGSIZE)
+    panic("initlog: log too big");
+  if (sb->nlog - 2 < MAXOPRESERVE)
+    panic("initlog: log too small");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.nring = sb->nlog - 1;
   log.dev = dev;
+  initsleeplock(&hbuf.lock, "loghead");
+  hbuf.dev = dev;
+  lbufs[0] = &hbuf;
+  for (i = 0; i < LOGSIZE; i++) {
+    initsleeplock(&snap[i].lock, "logsnap");
+    snap[i].dev = dev;
+    lbufs[1+i] = &snap[i];
+  }
+  initsleeplock(&sbuf.lock, "logsuper");
+  sbuf.dev = dev;
+  for (i = 0; i < MAXIOBLOCKS; i++) {
+    initsleeplock(&ckpt[i].lock, "logckpt");
+    ckpt[i].dev = dev;
+    ckbufs[i] = &ckpt[i];
+  }
   recover_from_log();
+  kthread(committer, "logcommit");
+  kthread(flusher, "logflush");
 }
 
-// Copy committed blocks from log to their home location
+// Disk block of ring position pos.
+static uint
+ringblock(uint pos)
+{
+  return log.start + 1 + pos % log.nring;
+}
+
+// Cache block writes being batched by logio_add(), for recovery.
+struct logio {
+  struct buf *cur[NLOGIO];  // run being gathered
+  int ncur;
+  struct buf *prev[NLOGIO]; // run in flight
+  int nprev;
+};
+
+// Start writing the gathered run, then wait for the one
+// before it and release its bufs.
 static void
-install_trans(void)
+logio_flush(struct logio *io)
 {
+  int i;
+
+  if (io->ncur > 0)
+    bwritev_async(io->cur, io->ncur);
+  for (i = 0; i < io->nprev; i++) {
+    bwait(io->prev[i]);
+    brelse(io->prev[i]);
+  }
+  for (i = 0; i < io->ncur; i++)
+    io->prev[i] = io->cur[i];
+  io->nprev = io->ncur;
+  io->ncur = 0;
+}
+
+// Queue locked buf b to be written, and released once it has been.
+static void
+logio_add(struct logio *io, struct buf *b)
+{
+  if (io->ncur == NLOGIO ||
+      (io->ncur > 0 && b->blockno != io->cur[io->ncur-1]->blockno + 1))
+    logio_flush(io);
+  io->cur[io->ncur++] = b;
+}
+
+// Wait for all the writes queued on io.
+static void
+logio_wait(struct logio *io)
+{
+  logio_flush(io);
+  logio_flush(io);
+}
+
+// Copy the committed blocks of the transaction lh at ring
+// position pos to their home location, after a crash.
+static void
+install_trans(uint pos, struct logheader *lh)
+{
+  struct logio io = { 0 };
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
+  for (tail = 0; tail < lh->n; tail++) {
+    struct buf *lbuf = bread(log.dev, ringblock(pos+1+tail)); // read log block
+    struct buf *dbuf = bread(log.dev, lh->block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
     brelse(lbuf);
-    brelse(dbuf);
+    logio_add(&io, dbuf);  // write dst to disk
   }
+  logio_wait(&io);
 }
 
-// Read the log header from disk into the in-memory log header
-static void
-read_head(void)
+// Fold the n bytes at p, a multiple of 4, into the running
+// checksum sum.
+static uint64
+cksum(uint64 sum, void *p, int n)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  uint *w = (uint *) p;
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
-  brelse(buf);
+
+  for (i = 0; i < n/4; i++)
+    sum = sum * 0x100000001b3L + w[i];
+  return sum;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
+// Checksum of header lh, to be folded into with its blocks.
+static uint64
+headsum(struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  return cksum(0, &lh->seq, sizeof(lh->seq) + sizeof(lh->n) +
+               lh->n * sizeof(lh->block[0]));
+}
+
+static uint
+sumdone(uint64 sum)
+{
+  return sum ^ (sum >> 32);
+}
+
+// Read the log header at ring position pos into lh.
+// Return 0 if it cannot be one we wrote.
+static int
+read_head(uint pos, struct logheader *lh)
+{
+  struct buf *buf = bread(log.dev, ringblock(pos));
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  lh->cksum = hb->cksum;
+  lh->seq = hb->seq;
+  lh->n = hb->n;
+  if (lh->n <= 0 || lh->n > log.nring - 1) {
+    brelse(buf);
+    return 0;
+  }
+  for (i = 0; i < lh->n; i++) {
+    lh->block[i] = hb->block[i];
   }
-  bwrite(buf);
   brelse(buf);
+  return 1;
+}
+
+// Is the transaction lh at ring position pos complete?
+static int
+log_complete(uint pos, struct logheader *lh)
+{
+  uint64 sum;
+  int i;
+
+  sum = headsum(lh);
+  for (i = 0; i < lh->n; i++) {
+    struct buf *b = bread(log.dev, ringblock(pos+1+i));
+    sum = cksum(sum, b->data, BSIZE);
+    brelse(b);
+  }
+  return sumdone(sum) == lh->cksum;
+}
+
+// Point the log super block at ring position tail, where the
+// transaction numbered seq is. Caller holds sbuf.lock.
+static void
+write_super(uint tail, uint seq)
+{
+  struct logsuper *ls = (struct logsuper *) sbuf.data;
+
+  memset(sbuf.data, 0, BSIZE);
+  ls->tail = tail % log.nring;
+  ls->seq = seq;
+  sbuf.blockno = log.start;
+  bwrite_async(&sbuf);
+  bwait(&sbuf);
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
+  struct buf *buf = bread(log.dev, log.start);
+  struct logsuper *ls = (struct logsuper *) (buf->data);
+  uint pos = ls->tail % log.nring;
+  uint seq = ls->seq;
+
+  brelse(buf);
+  // if committed, copy from log to disk
+  while (read_head(pos, &log.lh) && log.lh.seq == seq &&
+         log_complete(pos, &log.lh)) {
+    install_trans(pos, &log.lh);
+    pos += 1 + log.lh.n;
+    seq++;
+  }
   log.lh.n = 0;
-  write_head(); // clear the log
+  log.seq = log.done = seq;
+  log.head = log.committed = log.tail = pos;
+
+  // everything is installed; empty the log.
+  acquiresleep(&sbuf.lock);
+  write_super(pos, seq);
+  releasesleep(&sbuf.lock);
 }
 
-// called at the start of each FS system call.
+// The most blocks an op may reserve, up to n.
+int
+log_maxop(int n)
+{
+  return n < log.nring - 1 ? n : log.nring - 1;
+}
+
+// called at the start of each FS system call, which
+// writes at most nblocks distinct blocks.
 void
-begin_op(void)
+begin_op(int nblocks)
 {
+  if(nblocks > log.nring - 1)
+    panic("begin_op: too many blocks");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.committing || log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(1 + log.lh.n + log.reserved + nblocks > log.nring){
+      // this op might make the transaction too big for the
+      // log; close it and wait for the commit to take it.
+      log.closing = 1;
+      wakeup(&ticks);
+      sleep(&log, &log.lock);
+    } else if((log.head - log.tail) + 1 + log.lh.n + log.reserved + nblocks > log.nring){
+      // the transaction might not fit in what is left of the
+      // ring; wait for flusher() to install old ones.
+      log.ckwant = 1;
+      wakeup(&ticks);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += nblocks;
+      myproc()->logres = nblocks;
       release(&log.lock);
       break;
     }
@@ -141,69 +383,259 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// the commit happens later, in committer().
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+  log.reserved -= myproc()->logres;
+  if(log.outstanding < 0)
+    panic("end_op");
+  if(log.outstanding == 0 && log.closing){
+    // committer() is waiting for us.
+    wakeup(&ticks);
   }
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
   release(&log.lock);
+}
+
+// Write bs[0..n-1] to the blocks in their blockno, in
+// runs of consecutive blocks, and wait for them.
+static void
+write_bufs(struct buf **bs, int n)
+{
+  int i, j;
+
+  for (i = 0; i < n; i = j) {
+    for (j = i+1; j < n && j-i < MAXIOBLOCKS &&
+                  bs[j]->blockno == bs[j-1]->blockno + 1; j++)
+      ;
+    bwritev_async(&bs[i], j-i);
+  }
+  for (i = 0; i < n; i++)
+    bwait(bs[i]);
+}
+
+// Copy the blocks of the transaction in clh from the cache,
+// and record them at ring position pos for flusher().
+// No FS system calls may be active.
+static void
+snapshot(uint pos)
+{
+  int i;
+
+  ring[pos % log.nring].seq = clh.seq;
+  ring[pos % log.nring].n = clh.n;
+  for (i = 0; i < clh.n; i++) {
+    struct buf *b = bread(log.dev, clh.block[i]); // pinned, so cached
+    memmove(snap[i].data, b->data, BSIZE);
+    ring[(pos+1+i) % log.nring].b = b;
+    brelse(b);
+  }
+}
+
+// Append the transaction in clh and snap[] to the log at
+// ring position pos.
+static void
+commit(uint pos)
+{
+  uint64 sum;
+  int i;
+
+  sum = headsum(&clh);
+  for (i = 0; i < clh.n; i++)
+    sum = cksum(sum, snap[i].data, BSIZE);
+  clh.cksum = sumdone(sum);
+
+  memset(hbuf.data, 0, BSIZE);
+  memmove(hbuf.data, &clh, sizeof(clh));
+  hbuf.blockno = ringblock(pos);
+  for (i = 0; i < clh.n; i++)
+    snap[i].blockno = ringblock(pos+1+i);
+  write_bufs(lbufs, 1+clh.n);    // Write header and snapshot -- the commit
+}
+
+// The commit thread. It sleeps on the clock, so that it
+// notices transactions that have been open too long, and
+// begin_op()/end_op() prod it early through the same channel.
+static void
+committer(void)
+{
+  uint pos;
+  int i;
+
+  // the header and snapshot bufs are ours for good.
+  for (i = 0; i < 1+LOGSIZE; i++)
+    acquiresleep(&lbufs[i]->lock);
+
+  for (;;) {
+    acquire(&log.lock);
+    for (;;) {
+      if (log.lh.n > 0 && ticks - log.opened >= COMMITTICKS)
+        log.closing = 1;
+      if (log.closing && log.outstanding == 0) {
+        if (log.lh.n > 0)
+          break;
+        // nothing was logged after all.
+        log.closing = 0;
+        wakeup(&log);
+      }
+      sleep(&ticks, &log.lock);
+    }
+
+    // take the transaction, holding off new ops while we copy it.
+    // begin_op() made sure there is room for it in the ring.
+    clh = log.lh;
+    clh.seq = log.seq++;
+    pos = log.head;
+    log.head += 1 + clh.n;
+    log.lh.n = 0;
+    log.closing = 0;
+    log.committing = 1;
+    release(&log.lock);
+
+    snapshot(pos);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
     acquire(&log.lock);
     log.committing = 0;
     wakeup(&log);
     release(&log.lock);
+
+    commit(pos);
+
+    acquire(&log.lock);
+    log.committed = pos + 1 + clh.n;
+    log.done = clh.seq + 1;
+    wakeup(&log);
+    wakeup(&ticks);
+    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Write ckpt[0..n-1] to their home blocks, then let the cache
+// bufs they were copied from go.
 static void
-write_log(void)
+ckpt_write(struct buf **bs, int n)
 {
-  int tail;
+  int i;
+
+  write_bufs(ckbufs, n);
+  for (i = 0; i < n; i++)
+    bunpin(bs[i]);
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+// Install the transaction numbered seq, of n blocks, whose
+// header is at ring position pos.
+static void
+checkpoint(uint pos, uint seq, int n)
+{
+  struct buf *bs[MAXIOBLOCKS];
+  struct buf *b;
+  uint lseq;
+  int i, nck;
+
+  nck = 0;
+  for (i = 0; i < n; i++) {
+    b = ring[(pos+1+i) % log.nring].b;
+    if (bread(log.dev, b->blockno) != b)  // pinned, so cached
+      panic("checkpoint");
+    while ((lseq = b->logseq) != seq) {
+      acquire(&log.lock);
+      if (lseq < log.done) {
+        // a later commit has it; leave b to that
+        // transaction's install.
+        release(&log.lock);
+        break;
+      }
+      // a later transaction has logged b but not yet
+      // committed it, so b->data is not safe to install
+      // and the copy in our transaction must stay in the
+      // log until it has.
+      brelse(b);
+      wakeup(&ticks);
+      while (log.done <= lseq)
+        sleep(&log, &log.lock);
+      release(&log.lock);
+      if (bread(log.dev, b->blockno) != b)
+        panic("checkpoint");
+    }
+    if (lseq != seq) {
+      brelse(b);
+      bunpin(b);
+      continue;
+    }
+    memmove(ckpt[nck].data, b->data, BSIZE);
+    ckpt[nck].blockno = b->blockno;
+    brelse(b);
+    bs[nck++] = b;  // stays pinned until written
+    if (nck == MAXIOBLOCKS) {
+      ckpt_write(bs, nck);
+      nck = 0;
+    }
   }
+  ckpt_write(bs, nck);
 }
 
+// Should flusher() install the committed transactions?
+static int
+ckpt_due(void)
+{
+  if (log.tail == log.committed)
+    return 0;
+  return log.ckwant || log.committed - log.tail > log.nring / 2 ||
+         ticks - log.ckticks >= CKPTTICKS;
+}
+
+// The install thread. It installs all the committed
+// transactions at once, then moves the log's tail past them.
 static void
-commit()
+flusher(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  uint pos, end, seq;
+  struct ringent *h;
+  int i;
+
+  // the install bufs are ours for good.
+  acquiresleep(&sbuf.lock);
+  for (i = 0; i < MAXIOBLOCKS; i++)
+    acquiresleep(&ckpt[i].lock);
+
+  for (;;) {
+    acquire(&log.lock);
+    while (!ckpt_due())
+      sleep(&ticks, &log.lock);
+    pos = log.tail;
+    end = log.committed;
+    release(&log.lock);
+
+    seq = 0;
+    while (pos != end) {
+      h = &ring[pos % log.nring];
+      checkpoint(pos, h->seq, h->n);
+      seq = h->seq + 1;
+      pos += 1 + h->n;
+    }
+    write_super(pos, seq);  // the ring before pos is free
+
+    acquire(&log.lock);
+    log.tail = pos;
+    log.ckwant = 0;
+    log.ckticks = ticks;
+    wakeup(&log);
+    release(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// committer() will write it to the log, and flusher() will
+// install it and let it go. Since those writes happen in kernel
+// threads, the block is charged to the calling process's
+// ru.oublock here, once per transaction it is dirtied in.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -213,9 +645,10 @@ commit()
 void
 log_write(struct buf *b)
 {
+  struct proc *p = myproc();
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.nring - 1)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -226,10 +659,14 @@ log_write(struct buf *b)
       break;
   }
   log.lh.block[i] = b->blockno;
+  b->logseq = log.seq;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
+    if (log.lh.n == 0)
+      log.opened = ticks;
     log.lh.n++;
+    if (p != 0)
+      p->ru.oublock++;
   }
   release(&log.lock);
 }
-
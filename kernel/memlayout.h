@@ -51,10 +51,6 @@
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
 
-// map kernel stacks beneath the trampoline,
-// each surrounded by invalid guard pages.
-#define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
-
 // User memory layout.
 // Address zero first:
 //   text
@@ -62,6 +58,12 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   ...
+//   THREADFRAME(NTHREAD-1) .. THREADFRAME(1) (clone()d threads' trapframes)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// threads sharing a page table each need their own trapframe
+// page; slot 0 is TRAPFRAME, which belongs to the leader.
+#define THREADFRAME(slot) (TRAPFRAME - (slot)*PGSIZE)
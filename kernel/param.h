@@ -1,13 +1,23 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC      4096  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
+#define NTHREAD      64  // maximum threads per address space, leader included
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // i-nodes cached before the cache grows
+#define NDENTRY     128  // directory name cache entries
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXOPBLOCKS  12  // max # of blocks most FS ops write
+#define MAXWRITEBLOCKS 40  // max # of blocks one filewrite() op writes
+#define LOGSIZE      126  // max blocks in on-disk log ring
+#define FSLOGSIZE    100  // blocks in the log ring mkfs makes
+#define NBUF         (LOGSIZE+MAXOPBLOCKS*3)  // minimum size of disk block
+                                          // cache: the log can pin LOGSIZE
+#define BRESERVE     256  // free pages the disk block cache leaves alone
+#define NREADAHEAD   8  // blocks to read ahead of a sequential reader
+#define NPREALLOC   16  // blocks set aside past a file's last block
+#define FSEXTENTS    1  // regular files map their blocks with extents
+#define MAXIOBLOCKS  16  // max blocks in one disk request
+#define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
@@ -3,45 +3,204 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "defs.h"
+#include "fs.h"
+#include "clone.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// Process structures are carved out of kalloc'd pages on demand,
+// up to NPROC of them, each with a kalloc'd kernel stack.
+// freeproc() puts them on the free list for reuse. When kalloc()
+// runs out of memory, procreclaim() gives back the pages whose
+// procs are all on the free list.
+#define PPERPAGE 6 // procs carved from each kalloc'd page
+
+struct pchunk
+{
+	struct proc proc[PPERPAGE];
+	struct pchunk *next;
+	int n;	   // procs created in this page
+	int nfree; // how many of them are on the free list
+};
+
+// the page a proc was carved from.
+#define PCHUNK(p) ((struct pchunk *)PGROUNDDOWN((uint64)(p)))
+
+struct
+{
+	struct spinlock lock;
+	struct proc *free;	   // UNUSED procs, linked through qnext
+	struct pchunk *chunks; // pages of procs
+	int nproc;			   // number of procs in chunks
+	int nused;			   // number of procs that are not UNUSED
+	int nwalk;			   // kill()s walking chunks without the lock
+} ptable;
+
+// RUNNABLE processes in FIFO order, linked through qnext.
+// A RUNNABLE proc is on the queue unless a scheduler has just
+// taken it off and is about to run it.
+struct
+{
+	struct spinlock lock;
+	struct proc *head;
+	struct proc *tail;
+} runq;
+
+// Processes in sleep(), hashed by channel.
+#define NSLEEPQ 64
+struct sleepq
+{
+	struct spinlock lock;
+	struct proc *head; // linked through sqnext/sqprev
+} sleepq[NSLEEPQ];
 
 struct proc *initproc;
 
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// helps ensure that wakeups of wait()ing
+// parents are not lost. protects p->parent,
+// p->children and p->sibling for every proc.
+// must be acquired before any p->lock.
+struct spinlock wait_lock;
+
 extern void forkret(void);
-static void wakeup1(struct proc *chan);
+static void kthreadret(void);
+static void wakeup1(struct proc *p);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
 // initialize the proc table at boot time.
+// procs themselves are created later, by procgrow().
 void procinit(void)
 {
-	struct proc *p;
+	if (sizeof(struct pchunk) > PGSIZE)
+		panic("procinit: pchunk");
 
 	initlock(&pid_lock, "nextpid");
-	for (p = proc; p < &proc[NPROC]; p++)
+	initlock(&wait_lock, "wait_lock");
+	initlock(&ptable.lock, "ptable");
+	initlock(&runq.lock, "runq");
+	for (int i = 0; i < NSLEEPQ; i++)
+		initlock(&sleepq[i].lock, "sleepq");
+}
+
+// Carve a page's worth of new procs and put them on the
+// free list. Each gets a kernel stack page of its own; the
+// stacks are used through the kernel's direct mapping of
+// physical memory, so they can be freed without touching the
+// kernel page table (and other harts' TLBs).
+// Caller must not hold ptable.lock: the pages are allocated
+// first, since kalloc() may call procreclaim() and the
+// other caches' reclaimers.
+// Returns -1 if no proc could be created.
+static int
+procgrow(void)
+{
+	struct pchunk *c;
+	struct proc *p;
+	char *stacks[PPERPAGE];
+	int i, n, nstack;
+
+	if ((c = (struct pchunk *)kalloc()) == 0)
+		return -1;
+	memset(c, 0, PGSIZE);
+	for (nstack = 0; nstack < PPERPAGE; nstack++)
+		if ((stacks[nstack] = kalloc()) == 0)
+			break;
+
+	acquire(&ptable.lock);
+	n = nstack;
+	if (n > NPROC - ptable.nproc)
+		n = NPROC - ptable.nproc;
+	for (i = 0; i < n; i++)
 	{
+		p = &c->proc[i];
 		initlock(&p->lock, "proc");
+		p->state = UNUSED;
+		p->kstack = (uint64)stacks[i];
+		p->qnext = ptable.free;
+		ptable.free = p;
+		ptable.nproc++;
+	}
+	if (n > 0)
+	{
+		c->n = c->nfree = n;
+		c->next = ptable.chunks;
+		ptable.chunks = c;
+	}
+	release(&ptable.lock);
+
+	for (i = n > 0 ? n : 0; i < nstack; i++)
+		kfree(stacks[i]);
+	if (n <= 0)
+	{
+		kfree(c);
+		return -1;
+	}
+	return 0;
+}
+
+// Free the pages of procs that are all UNUSED, with their
+// kernel stacks, for kalloc() when it runs out of memory.
+// Returns the number of pages freed.
+int procreclaim(void)
+{
+	struct pchunk *c, **cp, *freed;
+	struct proc *p, **pp;
+	int i, n;
+
+	acquire(&ptable.lock);
+	if (ptable.nwalk > 0)
+	{
+		release(&ptable.lock);
+		return 0;
+	}
+
+	freed = 0;
+	n = 0;
+	for (cp = &ptable.chunks; (c = *cp) != 0;)
+	{
+		// A proc on the free list is out of everyone's reach,
+		// but freeproc()'s caller may not have released its
+		// lock yet.
+		for (i = 0; i < c->n; i++)
+			if (c->proc[i].lock.locked)
+				break;
+		if (c->nfree < c->n || i < c->n)
+		{
+			cp = &c->next;
+			continue;
+		}
+		*cp = c->next;
+		c->next = freed;
+		freed = c;
+		c->nfree = -1; // mark for the free-list pass below
+		ptable.nproc -= c->n;
+		n++;
+	}
+	for (pp = &ptable.free; (p = *pp) != 0;)
+	{
+		if (PCHUNK(p)->nfree < 0)
+			*pp = p->qnext;
+		else
+			pp = &p->qnext;
+	}
+	release(&ptable.lock);
 
-		// Allocate a page for the process's kernel stack.
-		// Map it high in memory, followed by an invalid
-		// guard page.
-		char *pa = kalloc();
-		if (pa == 0)
-			panic("kalloc");
-		uint64 va = KSTACK((int)(p - proc));
-		kvmmap(va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-		p->kstack = va;
+	while ((c = freed) != 0)
+	{
+		freed = c->next;
+		for (i = 0; i < c->n; i++)
+			kfree((void *)c->proc[i].kstack);
+		kfree(c);
 	}
-	kvminithart();
+	return n;
 }
 
 // Must be called with interrupts disabled,
@@ -86,42 +245,47 @@ int allocpid()
 	return pid;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// Take an UNUSED proc off the free list, growing the
+// table if it is empty. If found, initialize state required
+// to run in the kernel, and return with p->lock held.
+// Unless shared is set, also give it an empty user page table;
+// otherwise the caller installs an existing one (see clone()).
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc *
-allocproc(void)
+allocproc(int shared)
 {
 	struct proc *p;
 
-	for (p = proc; p < &proc[NPROC]; p++)
+	acquire(&ptable.lock);
+	while (ptable.free == 0)
 	{
-		acquire(&p->lock);
-		if (p->state == UNUSED)
-		{
-			goto found;
-		}
-		else
-		{
-			release(&p->lock);
-		}
+		release(&ptable.lock);
+		if (procgrow() < 0)
+			return 0;
+		acquire(&ptable.lock);
 	}
-	return 0;
+	p = ptable.free;
+	ptable.free = p->qnext;
+	p->qnext = 0;
+	PCHUNK(p)->nfree--;
+	ptable.nused++;
+	release(&ptable.lock);
 
-found:
+	acquire(&p->lock);
 	p->pid = allocpid();
+	p->state = USED;
 
 	// Allocate a trapframe page.
 	if ((p->trapframe = (struct trapframe *)kalloc()) == 0)
 	{
+		freeproc(p);
 		release(&p->lock);
 		return 0;
 	}
+	p->trapva = TRAPFRAME;
 
 	// An empty user page table.
-	p->pagetable = proc_pagetable(p);
-	if (p->pagetable == 0)
+	if (!shared && (p->pagetable = proc_pagetable(p)) == 0)
 	{
 		freeproc(p);
 		release(&p->lock);
@@ -139,24 +303,86 @@ found:
 
 // free a proc structure and the data hanging from it,
 // including user pages.
-// p->lock must be held.
+// p->lock must be held, and wait_lock too if p is a thread
+// that has been given a parent.
 static void
 freeproc(struct proc *p)
 {
+	if (p->thread)
+	{
+		// the page table belongs to our leader; just take
+		// our trapframe back out of it.
+		if (p->pagetable)
+			uvmunmap(p->pagetable, p->trapva, 1, 0);
+		if (p->parent)
+			p->parent->threadslots &= ~(1L << p->tslot);
+	}
+	else if (p->pagetable)
+		proc_freepagetable(p->pagetable, p->sz);
 	if (p->trapframe)
 		kfree((void *)p->trapframe);
 	p->trapframe = 0;
-	if (p->pagetable)
-		proc_freepagetable(p->pagetable, p->sz);
 	p->pagetable = 0;
+	p->thread = 0;
+	p->tslot = 0;
+	p->threadslots = 0;
+	p->ustack = 0;
 	p->sz = 0;
 	p->pid = 0;
 	p->parent = 0;
+	p->children = 0;
+	p->sibling = 0;
 	p->name[0] = 0;
+	p->kfn = 0;
 	p->chan = 0;
 	p->killed = 0;
 	p->xstate = 0;
+	memset(&p->ru, 0, sizeof(p->ru));
+	memset(&p->cru, 0, sizeof(p->cru));
 	p->state = UNUSED;
+
+	acquire(&ptable.lock);
+	p->qnext = ptable.free;
+	ptable.free = p;
+	PCHUNK(p)->nfree++;
+	ptable.nused--;
+	release(&ptable.lock);
+}
+
+// Mark p RUNNABLE and append it to the run queue.
+// Caller must hold p->lock.
+static void
+makerunnable(struct proc *p)
+{
+	p->state = RUNNABLE;
+
+	acquire(&runq.lock);
+	p->qnext = 0;
+	if (runq.tail)
+		runq.tail->qnext = p;
+	else
+		runq.head = p;
+	runq.tail = p;
+	release(&runq.lock);
+}
+
+// Take the proc at the head of the run queue, or return 0.
+static struct proc *
+runqget(void)
+{
+	struct proc *p;
+
+	acquire(&runq.lock);
+	p = runq.head;
+	if (p)
+	{
+		runq.head = p->qnext;
+		if (runq.head == 0)
+			runq.tail = 0;
+		p->qnext = 0;
+	}
+	release(&runq.lock);
+	return p;
 }
 
 // Create a user page table for a given process,
@@ -219,7 +445,7 @@ void userinit(void)
 {
 	struct proc *p;
 
-	p = allocproc();
+	p = allocproc(0);
 	initproc = p;
 
 	// allocate one user page and copy init's instructions
@@ -234,8 +460,23 @@ void userinit(void)
 	safestrcpy(p->name, "initcode", sizeof(p->name));
 	p->cwd = namei("/");
 
-	p->state = RUNNABLE;
+	makerunnable(p);
+
+	release(&p->lock);
+}
+
+// Start a kernel thread that runs fn(), which must not return.
+// It has no user memory and never leaves the kernel.
+void kthread(void (*fn)(void), char *name)
+{
+	struct proc *p;
 
+	if ((p = allocproc(1)) == 0)
+		panic("kthread");
+	p->kfn = fn;
+	p->context.ra = (uint64)kthreadret;
+	safestrcpy(p->name, name, sizeof(p->name));
+	makerunnable(p);
 	release(&p->lock);
 }
 
@@ -244,13 +485,28 @@ void userinit(void)
 int growproc(int n)
 {
 	uint sz;
+	struct proc *t, *leader;
 	struct proc *p = myproc();
 
+	// threads share one page table, so they must take turns
+	// growing it and all of them must see the new size.
+	// shrinking it would need a TLB shootdown on every hart
+	// running one of them, which we don't have.
+	int shared = p->thread || p->threadslots != 0;
+	if (shared)
+	{
+		if (n < 0)
+			return -1;
+		acquire(&wait_lock);
+	}
+
 	sz = p->sz;
 	if (n > 0)
 	{
 		if ((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0)
 		{
+			if (shared)
+				release(&wait_lock);
 			return -1;
 		}
 	}
@@ -258,20 +514,49 @@ int growproc(int n)
 	{
 		sz = uvmdealloc(p->pagetable, sz, sz + n);
 	}
-	p->sz = sz;
+
+	if (shared)
+	{
+		leader = p->thread ? p->parent : p;
+		leader->sz = sz;
+		for (t = leader->children; t; t = t->sibling)
+			if (t->thread)
+				t->sz = sz;
+		release(&wait_lock);
+	}
+	else
+		p->sz = sz;
 	return 0;
 }
 
+// Give np its own references to p's open files and
+// current directory, and the rest of what a child inherits.
+static void
+inherit(struct proc *np, struct proc *p)
+{
+	int i;
+
+	// increment reference counts on open file descriptors.
+	for (i = 0; i < NOFILE; i++)
+		if (p->ofile[i])
+			np->ofile[i] = filedup(p->ofile[i]);
+	np->cwd = idup(p->cwd);
+
+	np->mask = p->mask;
+
+	safestrcpy(np->name, p->name, sizeof(p->name));
+}
+
 // Create a new process, copying the parent.
 // Sets up child kernel stack to return as if from fork() system call.
 int fork(void)
 {
-	int i, pid;
+	int pid;
 	struct proc *np;
 	struct proc *p = myproc();
 
 	// Allocate process.
-	if ((np = allocproc()) == 0)
+	if ((np = allocproc(0)) == 0)
 	{
 		return -1;
 	}
@@ -285,58 +570,174 @@ int fork(void)
 	}
 	np->sz = p->sz;
 
-	np->parent = p;
-
-	np->mask = p->mask;
-
 	// copy saved user registers.
 	*(np->trapframe) = *(p->trapframe);
 
 	// Cause fork to return 0 in the child.
 	np->trapframe->a0 = 0;
 
-	// increment reference counts on open file descriptors.
-	for (i = 0; i < NOFILE; i++)
-		if (p->ofile[i])
-			np->ofile[i] = filedup(p->ofile[i]);
-	np->cwd = idup(p->cwd);
+	inherit(np, p);
 
-	safestrcpy(np->name, p->name, sizeof(p->name));
+	pid = np->pid;
+
+	release(&np->lock);
+
+	acquire(&wait_lock);
+	np->parent = p;
+	np->sibling = p->children;
+	p->children = np;
+	release(&wait_lock);
+
+	acquire(&np->lock);
+	makerunnable(np);
+	release(&np->lock);
+
+	return pid;
+}
+
+// Create a thread that runs fn(arg) on the given stack, which
+// should point just past the end of the thread's stack memory.
+// The thread shares the caller's page table, so its only private
+// user page is its trapframe, mapped at a free THREADFRAME slot.
+// It gets its own references to the caller's open files and cwd.
+// Its parent is the thread group's leader, and any thread in the
+// group can reap it with join(). fn must finish by calling exit().
+// flags must be CLONE_VM; fork() covers the copying case.
+int clone(uint64 fn, uint64 stack, int flags, uint64 arg)
+{
+	int pid, slot;
+	struct proc *np, *leader;
+	struct proc *p = myproc();
+
+	if (flags != CLONE_VM)
+		return -1;
+
+	if ((np = allocproc(1)) == 0)
+		return -1;
+	np->thread = 1;
+	np->ustack = stack;
+
+	*(np->trapframe) = *(p->trapframe);
+	np->trapframe->epc = fn;
+	np->trapframe->sp = stack;
+	np->trapframe->a0 = arg;
+	np->trapframe->ra = 0;
 
 	pid = np->pid;
 
-	np->state = RUNNABLE;
+	release(&np->lock);
 
+	acquire(&wait_lock);
+	leader = p->thread ? p->parent : p;
+	for (slot = 1; slot < NTHREAD; slot++)
+		if ((leader->threadslots & (1L << slot)) == 0)
+			break;
+	if (slot == NTHREAD ||
+		mappages(leader->pagetable, THREADFRAME(slot), PGSIZE,
+				 (uint64)np->trapframe, PTE_R | PTE_W) < 0)
+	{
+		release(&wait_lock);
+		acquire(&np->lock);
+		freeproc(np);
+		release(&np->lock);
+		return -1;
+	}
+	leader->threadslots |= 1L << slot;
+	np->tslot = slot;
+	np->trapva = THREADFRAME(slot);
+	np->pagetable = leader->pagetable;
+	np->sz = leader->sz;
+	np->parent = leader;
+	np->sibling = leader->children;
+	leader->children = np;
+	release(&wait_lock);
+
+	inherit(np, p);
+
+	acquire(&np->lock);
+	makerunnable(np);
 	release(&np->lock);
 
 	return pid;
 }
 
-// Pass p's abandoned children to init.
-// Caller must hold p->lock.
-void reparent(struct proc *p)
+// Kill leader p's threads and reap them, since they run
+// in the address space p is about to give up.
+static void
+killthreads(struct proc *p)
 {
-	struct proc *pp;
+	struct proc *np, **pp;
+	int live;
 
-	for (pp = proc; pp < &proc[NPROC]; pp++)
+	acquire(&wait_lock);
+	for (;;)
 	{
-		// this code uses pp->parent without holding pp->lock.
-		// acquiring the lock first could cause a deadlock
-		// if pp or a child of pp were also in exit()
-		// and about to try to lock p.
-		if (pp->parent == p)
+		live = 0;
+		for (pp = &p->children; (np = *pp) != 0;)
 		{
-			// pp->parent can't change between the check and the acquire()
-			// because only the parent changes it, and we're the parent.
-			acquire(&pp->lock);
-			pp->parent = initproc;
-			// we should wake up init here, but that would require
-			// initproc->lock, which would be a deadlock, since we hold
-			// the lock on one of init's children (pp). this is why
-			// exit() always wakes init (before acquiring any locks).
-			release(&pp->lock);
+			if (!np->thread)
+			{
+				pp = &np->sibling;
+				continue;
+			}
+			acquire(&np->lock);
+			if (np->state == ZOMBIE)
+			{
+				*pp = np->sibling;
+				freeproc(np);
+				release(&np->lock);
+				continue;
+			}
+			np->killed = 1;
+			if (np->state == SLEEPING)
+				makerunnable(np);
+			release(&np->lock);
+			live = 1;
+			pp = &np->sibling;
 		}
+		if (!live)
+			break;
+		// exiting threads wake us via wakeup(p->parent).
+		sleep(p, &wait_lock);
 	}
+	release(&wait_lock);
+}
+
+// Add src's counters into dst.
+static void
+ruadd(struct rusage *dst, struct rusage *src)
+{
+	dst->utime += src->utime;
+	dst->stime += src->stime;
+	dst->nvcsw += src->nvcsw;
+	dst->nivcsw += src->nivcsw;
+	dst->inblock += src->inblock;
+	dst->oublock += src->oublock;
+}
+
+// Pass p's abandoned children to init.
+// Caller must hold wait_lock.
+void reparent(struct proc *p)
+{
+	struct proc *pp, *last;
+
+	if (p->children == 0)
+		return;
+
+	last = 0;
+	for (pp = p->children; pp; pp = pp->sibling)
+	{
+		pp->parent = initproc;
+		last = pp;
+	}
+
+	// splice the whole list onto the front of init's children.
+	last->sibling = initproc->children;
+	initproc->children = p->children;
+	p->children = 0;
+
+	// some of them may already be zombies.
+	wakeup1(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -349,6 +750,9 @@ void exit(int status)
 	if (p == initproc)
 		panic("init exiting");
 
+	if (!p->thread)
+		killthreads(p);
+
 	// Close all open files.
 	for (int fd = 0; fd < NOFILE; fd++)
 	{
@@ -360,46 +764,26 @@ void exit(int status)
 		}
 	}
 
-	begin_op();
+	begin_op(TRUNCBLOCKS);
 	iput(p->cwd);
 	end_op();
 	p->cwd = 0;
 
-	// we might re-parent a child to init. we can't be precise about
-	// waking up init, since we can't acquire its lock once we've
-	// acquired any other proc lock. so wake up init whether that's
-	// necessary or not. init may miss this wakeup, but that seems
-	// harmless.
-	acquire(&initproc->lock);
-	wakeup1(initproc);
-	release(&initproc->lock);
-
-	// grab a copy of p->parent, to ensure that we unlock the same
-	// parent we locked. in case our parent gives us away to init while
-	// we're waiting for the parent lock. we may then race with an
-	// exiting parent, but the result will be a harmless spurious wakeup
-	// to a dead or wrong process; proc structs are never re-allocated
-	// as anything else.
-	acquire(&p->lock);
-	struct proc *original_parent = p->parent;
-	release(&p->lock);
-
-	// we need the parent's lock in order to wake it up from wait().
-	// the parent-then-child rule says we have to lock it first.
-	acquire(&original_parent->lock);
-
-	acquire(&p->lock);
+	acquire(&wait_lock);
 
 	// Give any children to init.
 	reparent(p);
 
-	// Parent might be sleeping in wait().
-	wakeup1(original_parent);
+	// Parent might be sleeping in wait(), and other
+	// threads of ours in join().
+	wakeup(p->parent);
+
+	acquire(&p->lock);
 
 	p->xstate = status;
 	p->state = ZOMBIE;
 
-	release(&original_parent->lock);
+	release(&wait_lock);
 
 	// Jump into the scheduler, never to return.
 	sched();
@@ -407,64 +791,158 @@ void exit(int status)
 }
 
 // Wait for a child process to exit and return its pid.
+// If ruaddr is non-zero, copy out the child's resource usage,
+// including that of its own reaped children.
 // Return -1 if this process has no children.
-int wait(uint64 addr)
+int wait(uint64 addr, uint64 ruaddr)
 {
-	struct proc *np;
+	struct rusage ru;
+	struct proc *np, **pp;
 	int havekids, pid;
 	struct proc *p = myproc();
 
-	// hold p->lock for the whole time to avoid lost
+	// hold wait_lock for the whole time to avoid lost
 	// wakeups from a child's exit().
-	acquire(&p->lock);
+	acquire(&wait_lock);
 
 	for (;;)
 	{
-		// Scan through table looking for exited children.
+		// Scan through our children looking for exited ones.
 		havekids = 0;
-		for (np = proc; np < &proc[NPROC]; np++)
+		for (pp = &p->children; (np = *pp) != 0; pp = &np->sibling)
 		{
-			// this code uses np->parent without holding np->lock.
-			// acquiring the lock first would cause a deadlock,
-			// since np might be an ancestor, and we already hold p->lock.
-			if (np->parent == p)
+			if (np->thread)
+				continue; // reaped by join()
+			havekids = 1;
+			acquire(&np->lock);
+			if (np->state == ZOMBIE)
 			{
-				// np->parent can't change between the check and the acquire()
-				// because only the parent changes it, and we're the parent.
-				acquire(&np->lock);
-				havekids = 1;
-				if (np->state == ZOMBIE)
+				// Found one.
+				pid = np->pid;
+				if (addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
+										 sizeof(np->xstate)) < 0)
 				{
-					// Found one.
-					pid = np->pid;
-					if (addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-											 sizeof(np->xstate)) < 0)
-					{
-						release(&np->lock);
-						release(&p->lock);
-						return -1;
-					}
-					freeproc(np);
 					release(&np->lock);
-					release(&p->lock);
-					return pid;
+					release(&wait_lock);
+					return -1;
 				}
+				ru = np->ru;
+				ruadd(&ru, &np->cru);
+				if (ruaddr != 0 && copyout(p->pagetable, ruaddr, (char *)&ru,
+										   sizeof(ru)) < 0)
+				{
+					release(&np->lock);
+					release(&wait_lock);
+					return -1;
+				}
+				// a thread's children count towards its leader,
+				// whose cru getrusage() reports.
+				ruadd(p->thread ? &p->parent->cru : &p->cru, &ru);
+				*pp = np->sibling;
+				freeproc(np);
 				release(&np->lock);
+				release(&wait_lock);
+				return pid;
 			}
+			release(&np->lock);
 		}
 
 		// No point waiting if we don't have any children.
 		if (!havekids || p->killed)
 		{
-			release(&p->lock);
+			release(&wait_lock);
 			return -1;
 		}
 
 		// Wait for a child to exit.
-		sleep(p, &p->lock); // DOC: wait-sleep
+		sleep(p, &wait_lock); // DOC: wait-sleep
 	}
 }
 
+// Wait for another thread of this thread group to exit and
+// return its pid. If addr is non-zero, copy out the stack
+// pointer the thread was given by clone().
+// Return -1 if there are no other threads.
+int join(uint64 addr)
+{
+	struct proc *np, **pp, *leader;
+	int havethreads, pid;
+	struct proc *p = myproc();
+
+	acquire(&wait_lock);
+
+	leader = p->thread ? p->parent : p;
+	for (;;)
+	{
+		havethreads = 0;
+		for (pp = &leader->children; (np = *pp) != 0; pp = &np->sibling)
+		{
+			if (!np->thread || np == p)
+				continue;
+			havethreads = 1;
+			acquire(&np->lock);
+			if (np->state == ZOMBIE)
+			{
+				pid = np->pid;
+				if (addr != 0 && copyout(p->pagetable, addr, (char *)&np->ustack,
+										 sizeof(np->ustack)) < 0)
+				{
+					release(&np->lock);
+					release(&wait_lock);
+					return -1;
+				}
+				// the leader's cru is guarded by wait_lock, unlike its ru.
+				ruadd(&leader->cru, &np->ru);
+				ruadd(&leader->cru, &np->cru);
+				*pp = np->sibling;
+				freeproc(np);
+				release(&np->lock);
+				release(&wait_lock);
+				return pid;
+			}
+			release(&np->lock);
+		}
+
+		if (!havethreads || p->killed)
+		{
+			release(&wait_lock);
+			return -1;
+		}
+
+		// exiting threads wake their leader's channel.
+		sleep(leader, &wait_lock);
+	}
+}
+
+// Copy the resource usage selected by who (RUSAGE_SELF or
+// RUSAGE_CHILDREN) out to user address addr.
+int getrusage(int who, uint64 addr)
+{
+	struct proc *p = myproc();
+	struct rusage ru;
+
+	if (who == RUSAGE_SELF)
+	{
+		// bring utime/stime up to date first.
+		uint64 now = r_time();
+		p->ru.stime += now - p->tstamp;
+		p->tstamp = now;
+		ru = p->ru;
+	}
+	else if (who == RUSAGE_CHILDREN)
+	{
+		acquire(&wait_lock);
+		ru = p->thread ? p->parent->cru : p->cru;
+		release(&wait_lock);
+	}
+	else
+		return -1;
+
+	if (copyout(p->pagetable, addr, (char *)&ru, sizeof(ru)) < 0)
+		return -1;
+	return 0;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -483,32 +961,27 @@ void scheduler(void)
 		// Avoid deadlock by ensuring that devices can interrupt.
 		intr_on();
 
-		int found = 0;
-		for (p = proc; p < &proc[NPROC]; p++)
+		if ((p = runqget()) == 0)
 		{
-			acquire(&p->lock);
-			if (p->state == RUNNABLE)
-			{
-				// Switch to chosen process.  It is the process's job
-				// to release its lock and then reacquire it
-				// before jumping back to us.
-				p->state = RUNNING;
-				c->proc = p;
-				swtch(&c->context, &p->context);
-
-				// Process is done running for now.
-				// It should have changed its p->state before coming back.
-				c->proc = 0;
-
-				found = 1;
-			}
-			release(&p->lock);
+			asm volatile("wfi");
+			continue;
 		}
-		if (found == 0)
+
+		acquire(&p->lock);
+		if (p->state == RUNNABLE)
 		{
-			intr_on();
-			asm volatile("wfi");
+			// Switch to chosen process.  It is the process's job
+			// to release its lock and then reacquire it
+			// before jumping back to us.
+			p->state = RUNNING;
+			c->proc = p;
+			swtch(&c->context, &p->context);
+
+			// Process is done running for now.
+			// It should have changed its p->state before coming back.
+			c->proc = 0;
 		}
+		release(&p->lock);
 	}
 }
 
@@ -533,9 +1006,18 @@ void sched(void)
 	if (intr_get())
 		panic("sched interruptible");
 
+	// charge the kernel time up to here, and count the switch.
+	p->ru.stime += r_time() - p->tstamp;
+	if (p->state == SLEEPING)
+		p->ru.nvcsw++;
+	else if (p->state == RUNNABLE)
+		p->ru.nivcsw++;
+
 	intena = mycpu()->intena;
 	swtch(&p->context, &mycpu()->context);
 	mycpu()->intena = intena;
+
+	p->tstamp = r_time();
 }
 
 // Give up the CPU for one scheduling round.
@@ -543,7 +1025,7 @@ void yield(void)
 {
 	struct proc *p = myproc();
 	acquire(&p->lock);
-	p->state = RUNNABLE;
+	makerunnable(p);
 	sched();
 	release(&p->lock);
 }
@@ -557,6 +1039,9 @@ void forkret(void)
 	// Still holding p->lock from scheduler.
 	release(&myproc()->lock);
 
+	// start charging time from our first run.
+	myproc()->tstamp = r_time();
+
 	if (first)
 	{
 		// File system initialization must be run in the context of a
@@ -569,11 +1054,42 @@ void forkret(void)
 	usertrapret();
 }
 
+// A kernel thread's first scheduling swtches here.
+static void kthreadret(void)
+{
+	struct proc *p = myproc();
+
+	// Still holding p->lock from scheduler.
+	release(&p->lock);
+	p->tstamp = r_time();
+
+	p->kfn();
+	panic("kthread returned");
+}
+
+static struct sleepq *
+sleepqof(void *chan)
+{
+	return &sleepq[((uint64)chan >> 3) % NSLEEPQ];
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
+// lk must not be p->lock.
 void sleep(void *chan, struct spinlock *lk)
 {
 	struct proc *p = myproc();
+	struct sleepq *q = sleepqof(chan);
+
+	// Join chan's sleep queue while still holding lk, so that
+	// a wakeup() issued once lk is released will find us.
+	acquire(&q->lock);
+	p->sqprev = 0;
+	p->sqnext = q->head;
+	if (q->head)
+		q->head->sqprev = p;
+	q->head = p;
+	release(&q->lock);
 
 	// Must acquire p->lock in order to
 	// change p->state and then call sched.
@@ -581,11 +1097,8 @@ void sleep(void *chan, struct spinlock *lk)
 	// guaranteed that we won't miss any wakeup
 	// (wakeup locks p->lock),
 	// so it's okay to release lk.
-	if (lk != &p->lock)
-	{					   // DOC: sleeplock0
-		acquire(&p->lock); // DOC: sleeplock1
-		release(lk);
-	}
+	acquire(&p->lock); // DOC: sleeplock1
+	release(lk);
 
 	// Go to sleep.
 	p->chan = chan;
@@ -595,13 +1108,22 @@ void sleep(void *chan, struct spinlock *lk)
 
 	// Tidy up.
 	p->chan = 0;
+	release(&p->lock);
+
+	// wakeup() leaves us on the queue, since it holds
+	// q->lock and must not take it again via p->lock.
+	acquire(&q->lock);
+	if (p->sqprev)
+		p->sqprev->sqnext = p->sqnext;
+	else
+		q->head = p->sqnext;
+	if (p->sqnext)
+		p->sqnext->sqprev = p->sqprev;
+	p->sqnext = p->sqprev = 0;
+	release(&q->lock);
 
 	// Reacquire original lock.
-	if (lk != &p->lock)
-	{
-		release(&p->lock);
-		acquire(lk);
-	}
+	acquire(lk);
 }
 
 // Wake up all processes sleeping on chan.
@@ -609,29 +1131,59 @@ void sleep(void *chan, struct spinlock *lk)
 void wakeup(void *chan)
 {
 	struct proc *p;
+	struct sleepq *q = sleepqof(chan);
 
-	for (p = proc; p < &proc[NPROC]; p++)
+	acquire(&q->lock);
+	for (p = q->head; p; p = p->sqnext)
 	{
 		acquire(&p->lock);
 		if (p->state == SLEEPING && p->chan == chan)
 		{
-			p->state = RUNNABLE;
+			makerunnable(p);
 		}
 		release(&p->lock);
 	}
+	release(&q->lock);
 }
 
-// Wake up p if it is sleeping in wait(); used by exit().
-// Caller must hold p->lock.
+// Wake up p if it is sleeping in wait(); used by exit()
+// and reparent(). Caller must hold wait_lock, which keeps
+// p from sleeping in wait() between the check and the wakeup.
 static void
 wakeup1(struct proc *p)
 {
-	if (!holding(&p->lock))
+	if (!holding(&wait_lock))
 		panic("wakeup1");
+	acquire(&p->lock);
 	if (p->chan == p && p->state == SLEEPING)
 	{
-		p->state = RUNNABLE;
+		makerunnable(p);
 	}
+	release(&p->lock);
+}
+
+// Return the first of the pages of procs, which can then be
+// followed through their next links without holding
+// ptable.lock: pages are only ever added at the head, and
+// procreclaim() frees none until the walk is done().
+static struct pchunk *
+walkprocs(void)
+{
+	struct pchunk *c;
+
+	acquire(&ptable.lock);
+	ptable.nwalk++;
+	c = ptable.chunks;
+	release(&ptable.lock);
+	return c;
+}
+
+static void
+walkdone(void)
+{
+	acquire(&ptable.lock);
+	ptable.nwalk--;
+	release(&ptable.lock);
 }
 
 // Kill the process with the given pid.
@@ -639,24 +1191,30 @@ wakeup1(struct proc *p)
 // to user space (see usertrap() in trap.c).
 int kill(int pid)
 {
+	struct pchunk *c;
 	struct proc *p;
 
-	for (p = proc; p < &proc[NPROC]; p++)
+	for (c = walkprocs(); c; c = c->next)
 	{
-		acquire(&p->lock);
-		if (p->pid == pid)
+		for (p = c->proc; p < &c->proc[c->n]; p++)
 		{
-			p->killed = 1;
-			if (p->state == SLEEPING)
+			acquire(&p->lock);
+			if (p->pid == pid)
 			{
-				// Wake process from sleep().
-				p->state = RUNNABLE;
+				p->killed = 1;
+				if (p->state == SLEEPING)
+				{
+					// Wake process from sleep().
+					makerunnable(p);
+				}
+				release(&p->lock);
+				walkdone();
+				return 0;
 			}
 			release(&p->lock);
-			return 0;
 		}
-		release(&p->lock);
 	}
+	walkdone();
 	return -1;
 }
 
@@ -701,37 +1259,41 @@ void procdump(void)
 {
 	static char *states[] = {
 		[UNUSED] "unused",
+		[USED] "used  ",
 		[SLEEPING] "sleep ",
 		[RUNNABLE] "runble",
 		[RUNNING] "run   ",
 		[ZOMBIE] "zombie"};
+	struct pchunk *c;
 	struct proc *p;
 	char *state;
 
 	printf("\n");
-	for (p = proc; p < &proc[NPROC]; p++)
+	for (c = ptable.chunks; c; c = c->next)
 	{
-		if (p->state == UNUSED)
-			continue;
-		if (p->state >= 0 && p->state < NELEM(states) && states[p->state])
-			state = states[p->state];
-		else
-			state = "???";
-		printf("%d %s %s", p->pid, state, p->name);
-		printf("\n");
+		for (p = c->proc; p < &c->proc[c->n]; p++)
+		{
+			if (p->state == UNUSED)
+				continue;
+			if (p->state >= 0 && p->state < NELEM(states) && states[p->state])
+				state = states[p->state];
+			else
+				state = "???";
+			// the time CSR ticks at 10 MHz under qemu; print ms.
+			printf("%d %s %s u=%dms s=%dms", p->pid, state, p->name,
+				   (int)(p->ru.utime / 10000), (int)(p->ru.stime / 10000));
+			printf("\n");
+		}
 	}
 }
 
+// Number of procs that could still be allocated.
 int calfreeproc(void)
 {
-	int i;
-	int freeprocnum = 0;
-	for(i = 0;i < NPROC;i++)
-	{
-		if(proc[i].killed||proc[i].pid == 0)
-		{
-			freeprocnum++;
-		}
-	}
+	int freeprocnum;
+
+	acquire(&ptable.lock);
+	freeprocnum = NPROC - ptable.nused;
+	release(&ptable.lock);
 	return freeprocnum;
 }
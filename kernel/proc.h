@@ -80,7 +80,7 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
-enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
 struct proc {
@@ -88,20 +88,43 @@ struct proc {
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  struct proc *parent;         // Parent process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
-  // these are private to the process, so p->lock need not be held.
+  // wait_lock must be held when using these:
+  struct proc *parent;         // Parent process
+  struct proc *children;       // First child; the rest follow via sibling
+  struct proc *sibling;        // Next child of the same parent
+  uint64 threadslots;          // THREADFRAME slots used by our threads
+  struct rusage cru;           // Usage of reaped children and threads
+
+  // ptable.lock (free list) or runq.lock must be held when using this:
+  struct proc *qnext;          // Next proc on the free list or run queue
+
+  // the sleep queue lock for chan must be held when using these:
+  struct proc *sqnext;         // Sleep queue links
+  struct proc *sqprev;
+
+  // set once when the proc is created, never changed:
   uint64 kstack;               // Virtual address of kernel stack
+
+  // these are private to the process, so p->lock need not be held.
+  int thread;                  // If non-zero, shares parent's page table
+  int tslot;                   // THREADFRAME slot of a thread
+  uint64 ustack;               // Stack passed to clone(), for join()
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 trapva;               // where trapframe is mapped in pagetable
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
   int mask;                    // The system call number used
+  void (*kfn)(void);           // What a kernel thread runs
+  int logres;                  // Log blocks reserved by begin_op()
+  struct rusage ru;            // Our own resource usage
+  uint64 tstamp;               // time CSR when ru was last charged
 };
@@ -0,0 +1,13 @@
+// Resource usage, as reported by getrusage() and wait2().
+// Times are in cycles of the time CSR (10 MHz under qemu).
+struct rusage {
+  uint64 utime;     // time spent in user mode
+  uint64 stime;     // time spent in the kernel
+  uint64 nvcsw;     // voluntary context switches (slept)
+  uint64 nivcsw;    // involuntary context switches (preempted)
+  uint64 inblock;   // blocks read from disk
+  uint64 oublock;   // blocks written to disk
+};
+
+#define RUSAGE_SELF     0  // the calling process
+#define RUSAGE_CHILDREN 1  // its reaped children and threads
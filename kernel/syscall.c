@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "syscall.h"
 #include "defs.h"
@@ -102,6 +103,13 @@ extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
 extern uint64 sys_trace(void);
 extern uint64 sys_sysinfo(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_futex_wait(void);
+extern uint64 sys_futex_wake(void);
+extern uint64 sys_getrusage(void);
+extern uint64 sys_wait2(void);
+extern uint64 sys_diskpoll(void);
 
 static uint64 (*syscalls[])(void) = {
 	[SYS_fork] sys_fork,
@@ -126,10 +134,17 @@ static uint64 (*syscalls[])(void) = {
 	[SYS_mkdir] sys_mkdir,
 	[SYS_close] sys_close,
 	[SYS_trace] sys_trace,
-	[SYS_sysinfo] sys_sysinfo
+	[SYS_sysinfo] sys_sysinfo,
+	[SYS_clone] sys_clone,
+	[SYS_join] sys_join,
+	[SYS_futex_wait] sys_futex_wait,
+	[SYS_futex_wake] sys_futex_wake,
+	[SYS_getrusage] sys_getrusage,
+	[SYS_wait2] sys_wait2,
+	[SYS_diskpoll] sys_diskpoll
 };
 
-static char sysname[32][8] = {"",
+static char sysname[32][16] = {"",
 						 "fork",
 						 "exit",
 						 "wait",
@@ -152,7 +167,14 @@ static char sysname[32][8] = {"",
 						 "mkdir",
 						 "close",
 						 "trace",
-						 "sysinfo"};
+						 "sysinfo",
+						 "clone",
+						 "join",
+						 "futex_wait",
+						 "futex_wake",
+						 "getrusage",
+						 "wait2",
+						 "diskpoll"};
 
 void syscall(void)
 {
@@ -21,4 +21,11 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_trace  22
-#define SYS_sysinfo  23
\ No newline at end of file
+#define SYS_sysinfo  23
+#define SYS_clone  24
+#define SYS_join   25
+#define SYS_futex_wait 26
+#define SYS_futex_wake 27
+#define SYS_getrusage 28
+#define SYS_wait2  29
+#define SYS_diskpoll 30
\ No newline at end of file
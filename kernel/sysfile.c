@@ -10,6 +10,7 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "fs.h"
 #include "sleeplock.h"
@@ -127,7 +128,7 @@ sys_link(void)
 	if (argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
 		return -1;
 
-	begin_op();
+	begin_op(LINKBLOCKS);
 	if ((ip = namei(old)) == 0)
 	{
 		end_op();
@@ -198,7 +199,7 @@ sys_unlink(void)
 	if (argstr(0, path, MAXPATH) < 0)
 		return -1;
 
-	begin_op();
+	begin_op(UNLINKBLOCKS);
 	if ((dp = nameiparent(path, name)) == 0)
 	{
 		end_op();
@@ -226,6 +227,7 @@ sys_unlink(void)
 	memset(&de, 0, sizeof(de));
 	if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
 		panic("unlink: writei");
+	dcache_set(dp, name, 0);
 	if (ip->type == T_DIR)
 	{
 		dp->nlink--;
@@ -306,7 +308,7 @@ sys_open(void)
 	if ((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
 		return -1;
 
-	begin_op();
+	begin_op((omode & O_CREATE ? CREATEBLOCKS : 0) + TRUNCBLOCKS);
 
 	if (omode & O_CREATE)
 	{
@@ -367,6 +369,8 @@ sys_open(void)
 	{
 		itrunc(ip);
 	}
+	if (omode & O_NOEXTENT)
+		iblockmap(ip);
 
 	iunlock(ip);
 	end_op();
@@ -380,7 +384,7 @@ sys_mkdir(void)
 	char path[MAXPATH];
 	struct inode *ip;
 
-	begin_op();
+	begin_op(CREATEBLOCKS);
 	if (argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0)
 	{
 		end_op();
@@ -398,7 +402,7 @@ sys_mknod(void)
 	char path[MAXPATH];
 	int major, minor;
 
-	begin_op();
+	begin_op(CREATEBLOCKS);
 	if ((argstr(0, path, MAXPATH)) < 0 ||
 		argint(1, &major) < 0 ||
 		argint(2, &minor) < 0 ||
@@ -419,7 +423,7 @@ sys_chdir(void)
 	struct inode *ip;
 	struct proc *p = myproc();
 
-	begin_op();
+	begin_op(TRUNCBLOCKS);
 	if (argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0)
 	{
 		end_op();
@@ -2,4 +2,9 @@ struct sysinfo {
   uint64 freemem;   // amount of free memory (bytes)
   uint64 nproc;     // number of process
   uint64 freefd;    // number of free file descriptor
+  uint64 nbuf;      // buffers in the disk block cache
+  uint64 bhit;      // disk block cache hits
+  uint64 bmiss;     // disk block cache misses
+  uint64 bevict;    // disk block cache evictions
+  uint64 nfreeblk;  // free disk blocks
 };
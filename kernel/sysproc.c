@@ -5,6 +5,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "rusage.h"
 #include "proc.h"
 #include "sysinfo.h"
 
@@ -36,7 +37,80 @@ sys_wait(void)
 	uint64 p;
 	if (argaddr(0, &p) < 0)
 		return -1;
-	return wait(p);
+	return wait(p, 0);
+}
+
+uint64
+sys_wait2(void)
+{
+	uint64 p, ru;
+	if (argaddr(0, &p) < 0 || argaddr(1, &ru) < 0)
+		return -1;
+	return wait(p, ru);
+}
+
+uint64
+sys_getrusage(void)
+{
+	int who;
+	uint64 ru;
+	if (argint(0, &who) < 0 || argaddr(1, &ru) < 0)
+		return -1;
+	return getrusage(who, ru);
+}
+
+uint64
+sys_clone(void)
+{
+	uint64 fn, stack, arg;
+	int flags;
+
+	if (argaddr(0, &fn) < 0 || argaddr(1, &stack) < 0 ||
+		argint(2, &flags) < 0 || argaddr(3, &arg) < 0)
+		return -1;
+	return clone(fn, stack, flags, arg);
+}
+
+uint64
+sys_join(void)
+{
+	uint64 p;
+	if (argaddr(0, &p) < 0)
+		return -1;
+	return join(p);
+}
+
+uint64
+sys_futex_wait(void)
+{
+	uint64 addr;
+	int val;
+
+	if (argaddr(0, &addr) < 0 || argint(1, &val) < 0)
+		return -1;
+	return futex_wait(addr, val);
+}
+
+uint64
+sys_futex_wake(void)
+{
+	uint64 addr;
+	int n;
+
+	if (argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+		return -1;
+	return futex_wake(addr, n);
+}
+
+// turn polled disk completion on or off.
+uint64
+sys_diskpoll(void)
+{
+	int on;
+
+	if (argint(0, &on) < 0)
+		return -1;
+	return virtio_disk_poll(on != 0);
 }
 
 uint64
@@ -97,6 +171,8 @@ sys_sysinfo(void)
 	info_temp.freemem = calfreemem();	
 	info_temp.nproc = calfreeproc();
 	info_temp.freefd = calfreefd();
+	bstat(&info_temp);
+	fsstat(&info_temp);
 
 	if(copyout(p->pagetable,info_addr,(char *)&info_temp,sizeof(info_temp))<0)
 		return -1;
@@ -45,7 +45,7 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 128
 
 struct VRingDesc {
   uint64 addr;
@@ -55,6 +55,7 @@ struct VRingDesc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr points to a table of descriptors
 
 struct VRingUsedElem {
   uint32 id;   // index of start of completed descriptor chain
@@ -69,4 +70,23 @@ struct UsedArea {
   uint16 flags;
   uint16 id;
   struct VRingUsedElem elems[NUM];
+  uint16 avail_event; // with EVENT_IDX: notify when avail idx passes this
+};
+
+// legacy queue layout: the descriptor table, then the avail
+// ring (flags, idx, ring[NUM], used_event), then the used
+// ring starting on the next page boundary.
+#define VRING_AVAIL_OFF (NUM*sizeof(struct VRingDesc))
+#define VRING_USED_OFF  PGROUNDUP(VRING_AVAIL_OFF + (3+NUM)*sizeof(uint16))
+
+// with EVENT_IDX: has idx moved past event since it was old?
+#define vring_need_event(event, idx, old) \
+  ((uint16)((idx) - (event) - 1) < (uint16)((idx) - (old)))
+#define VRING_SIZE      (VRING_USED_OFF + PGROUNDUP(sizeof(struct UsedArea)))
+
+// the first descriptor of a block request points to one of these.
+struct virtio_blk_req {
+  uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
+  uint32 reserved;
+  uint64 sector;
 };
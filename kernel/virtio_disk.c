@@ -20,19 +20,27 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// bytes in an indirect table for the largest request.
+#define ITABSZ ((MAXIOBLOCKS+2) * sizeof(struct VRingDesc))
+
+// the I/O scheduler keeps at most QDEPTH requests at the device,
+// and serves any request queued QDEADLINE ticks ago first.
+#define QDEPTH    32
+#define QDEADLINE 2
+
 static struct disk {
  // memory for virtio descriptors &c for queue 0.
  // this is a global instead of allocated because it must
  // be multiple contiguous pages, which kalloc()
  // doesn't support, and page aligned.
-  char pages[2*PGSIZE];
+  char pages[VRING_SIZE];
   struct VRingDesc *desc;
   uint16 *avail;
   struct UsedArea *used;
 
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 used_idx; // we've looked this far in used->elems[].
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
@@ -40,7 +48,35 @@ static struct disk {
   struct {
     struct buf *b;
     char status;
+    char waited;   // has a buf that is not async (see arm())
+    uint16 aseq;   // avail ring index it was given
   } info[NUM];
+
+  // request headers, indexed like info[]. here rather than
+  // on the caller's stack since the caller need not wait.
+  struct virtio_blk_req ops[NUM];
+
+  // with VIRTIO_RING_F_INDIRECT_DESC, each request takes just
+  // one ring descriptor, which points to a table describing
+  // the header, data and status. indexed like info[].
+  int indirect;
+  struct VRingDesc *itab[NUM];
+
+  // with VIRTIO_RING_F_EVENT_IDX, the device interrupts only when
+  // it passes our *used_event, and wants to be notified only when
+  // we pass its used->avail_event.
+  int event_idx;
+  uint16 *used_event;
+
+  // if set, waiters spin on the used ring rather than sleeping
+  // until the interrupt; see virtio_disk_poll().
+  int poll;
+
+  // the I/O scheduler's queue of requests not yet given to
+  // the device, sorted by block number and linked by qnext.
+  struct buf *queue;
+  int inflight;  // requests at the device
+  uint headpos;  // block after the last one dispatched
   
   struct spinlock vdisk_lock;
   
@@ -73,9 +109,9 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.indirect = (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+  disk.event_idx = (features & (1 << VIRTIO_RING_F_EVENT_IDX)) != 0;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -95,20 +131,33 @@ virtio_disk_init(void)
   if(max < NUM)
     panic("virtio disk max queue too short");
   *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_ALIGN) = PGSIZE;
   memset(disk.pages, 0, sizeof(disk.pages));
   *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
 
   // desc = pages -- num * VRingDesc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+  // avail = pages + VRING_AVAIL_OFF -- 2 * uint16, then num * uint16
+  // used = pages + VRING_USED_OFF -- 2 * uint16, then num * vRingUsedElem
 
   disk.desc = (struct VRingDesc *) disk.pages;
-  disk.avail = (uint16*)(((char*)disk.desc) + NUM*sizeof(struct VRingDesc));
-  disk.used = (struct UsedArea *) (disk.pages + PGSIZE);
+  disk.avail = (uint16*)(disk.pages + VRING_AVAIL_OFF);
+  disk.used = (struct UsedArea *) (disk.pages + VRING_USED_OFF);
+  disk.used_event = &disk.avail[2 + NUM];
 
   for(int i = 0; i < NUM; i++)
     disk.free[i] = 1;
 
+  // carve the indirect tables out of kalloc'd pages.
+  if(disk.indirect){
+    int per = PGSIZE / ITABSZ;
+    char *pa = 0;
+    for(int i = 0; i < NUM; i++){
+      if(i % per == 0 && (pa = kalloc()) == 0)
+        panic("virtio disk kalloc");
+      disk.itab[i] = (struct VRingDesc *)(pa + (i % per) * ITABSZ);
+    }
+  }
+
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
@@ -135,7 +184,6 @@ free_desc(int i)
     panic("virtio_disk_intr 2");
   disk.desc[i].addr = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
 }
 
 // free a chain of descriptors.
@@ -151,10 +199,11 @@ free_chain(int i)
   }
 }
 
+// allocate n descriptors, all or none.
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -165,106 +214,361 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// put the request headed by b on the ring, if there are
+// descriptors for it. the request covers b and the bufs
+// after it on b->rnext, which hold consecutive blocks.
+// caller must hold vdisk_lock, and notify the device.
+static int
+submit(struct buf *b, int write)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+  struct buf *x;
+  int i, n;
+
+  // the spec says that legacy block operations use one
+  // descriptor for type/reserved/sector, then one for each
+  // data buffer, then one for a 1-byte status result.
+  n = 0;
+  for(x = b; x; x = x->rnext)
+    n++;
+
+  // with indirect descriptors the request is laid out the same
+  // way, but in disk.itab[head] and linked by table index.
+  struct VRingDesc *desc;
+  int head, idx[MAXIOBLOCKS+2];
+  if(disk.indirect){
+    if((head = alloc_desc()) < 0)
+      return -1;
+    desc = disk.itab[head];
+    for(i = 0; i < n+2; i++)
+      idx[i] = i;
+  } else {
+    if(allocn_desc(idx, n+2) != 0)
+      return -1;
+    head = idx[0];
+    desc = disk.desc;
   }
   
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+  struct virtio_blk_req *buf0 = &disk.ops[head];
 
   if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk.desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk.desc[idx[0]].len = sizeof(buf0);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
+    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  desc[idx[0]].addr = (uint64) buf0;
+  desc[idx[0]].len = sizeof(*buf0);
+  desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  desc[idx[0]].next = idx[1];
+
+  for(i = 1, x = b; x; i++, x = x->rnext){
+    desc[idx[i]].addr = (uint64) x->data;
+    desc[idx[i]].len = BSIZE;
+    if(write)
+      desc[idx[i]].flags = 0; // device reads x->data
+    else
+      desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes x->data
+    desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    desc[idx[i]].next = idx[i+1];
+  }
 
-  disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.info[head].status = 0;
+  desc[idx[n+1]].addr = (uint64) &disk.info[head].status;
+  desc[idx[n+1]].len = 1;
+  desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  desc[idx[n+1]].next = 0;
+
+  if(disk.indirect){
+    disk.desc[head].addr = (uint64) desc;
+    disk.desc[head].len = (n+2) * sizeof(struct VRingDesc);
+    disk.desc[head].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[head].next = 0;
+  }
 
   // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.info[head].b = b;
+  disk.info[head].waited = 0;
+  for(x = b; x; x = x->rnext)
+    if(!x->async)
+      disk.info[head].waited = 1;
+  disk.info[head].aseq = disk.avail[1];
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
   // avail[2...] are desc[] indices the device should process.
   // we only tell device the first index in our chain of descriptors.
-  disk.avail[2 + (disk.avail[1] % NUM)] = idx[0];
+  disk.avail[2 + (disk.avail[1] % NUM)] = head;
   __sync_synchronize();
   disk.avail[1] = disk.avail[1] + 1;
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  return 0;
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+// tell the device about requests added to the avail ring
+// since its index was old, unless EVENT_IDX says it is not
+// interested yet.
+static void
+notify(uint16 old)
+{
+  __sync_synchronize();
+  if(!disk.event_idx ||
+     vring_need_event(disk.used->avail_event, disk.avail[1], old))
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// the I/O scheduler.
+//
+// requests wait on disk.queue in block order. a new request
+// that continues or precedes a queued one of the same kind is
+// merged into it, up to MAXIOBLOCKS. dispatch() hands them to
+// the device in one-way elevator order from disk.headpos, but
+// serves a request that has waited QDEADLINE ticks first, so
+// that a stream of nearby requests cannot starve it.
+
+// add the request headed by b, n blocks long, to the queue.
+static void
+enqueue(struct buf *b, int write, int n)
+{
+  struct buf **pp, *q, *last;
+
+  for(pp = &disk.queue; (q = *pp) != 0; pp = &q->qnext){
+    if(q->qwrite != write || q->qn + n > MAXIOBLOCKS)
+      continue;
+    if(q->blockno + q->qn == b->blockno){
+      // b continues q.
+      for(last = q; last->rnext; last = last->rnext)
+        ;
+      last->rnext = b;
+      q->qn += n;
+      return;
+    }
+    if(b->blockno + n == q->blockno){
+      // b precedes q; b becomes the head, in q's place.
+      for(last = b; last->rnext; last = last->rnext)
+        ;
+      last->rnext = q;
+      b->qwrite = write;
+      b->qn = n + q->qn;
+      b->qtime = q->qtime;
+      b->qnext = q->qnext;
+      *pp = b;
+      return;
+    }
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  b->qwrite = write;
+  b->qn = n;
+  b->qtime = ticks;
+  for(pp = &disk.queue; *pp && (*pp)->blockno < b->blockno; pp = &(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+  *pp = b;
+}
 
-  release(&disk.vdisk_lock);
+// choose the next request to dispatch; return a pointer
+// to the link that points to it.
+static struct buf**
+pick(void)
+{
+  struct buf **pp, **oldest, **next;
+
+  oldest = next = 0;
+  for(pp = &disk.queue; *pp; pp = &(*pp)->qnext){
+    if(oldest == 0 || (int)((*pp)->qtime - (*oldest)->qtime) < 0)
+      oldest = pp;
+    if(next == 0 && (*pp)->blockno >= disk.headpos)
+      next = pp;
+  }
+  if(oldest && ticks - (*oldest)->qtime >= QDEADLINE)
+    return oldest;
+  if(next)
+    return next;
+  return &disk.queue; // wrap around to the lowest block
+}
+
+// give queued requests to the device while it has room.
+// caller must hold vdisk_lock.
+static void
+dispatch(void)
+{
+  struct buf **pp, *b;
+  uint16 old = disk.avail[1];
+
+  while(disk.queue && disk.inflight < QDEPTH){
+    pp = pick();
+    b = *pp;
+    if(submit(b, b->qwrite) != 0)
+      break;
+    *pp = b->qnext;
+    disk.inflight++;
+    disk.headpos = b->blockno + b->qn;
+  }
+  if(disk.avail[1] != old)
+    notify(old);
+}
+
+// with EVENT_IDX, choose the used ring index at which the
+// device should next interrupt. requests are as a rule used in
+// the order they were made available, the one at avail index i
+// at used index i, so aim at the oldest in-flight request that
+// someone may be waiting for, or at the last one if all are
+// async. read-ahead then costs no interrupts of its own, though
+// a reader that wants a read-ahead block before the rest of the
+// batch is in waits for all of it. if the device finishes out
+// of order, the interrupt comes early (or, if the target has
+// already passed, at the next completion), and complete() aims
+// again from there.
+static void
+arm(void)
+{
+  uint16 d, dmin;
+  int i;
+
+  dmin = 0;
+  if(disk.inflight > 0){
+    dmin = (uint16)(disk.avail[1] - 1 - disk.used_idx);
+    for(i = 0; i < NUM; i++){
+      if(disk.info[i].b == 0 || !disk.info[i].waited)
+        continue;
+      d = (uint16)(disk.info[i].aseq - disk.used_idx);
+      if(d >= 0x8000)
+        d = 0;   // already passed
+      if(d < dmin)
+        dmin = d;
+    }
+  }
+  *disk.used_event = disk.used_idx + dmin;
+}
+
+// finish the requests the device has put on the used ring,
+// then submit waiting ones into the descriptors they freed.
+// caller must hold vdisk_lock.
+static void
+complete(void)
+{
+  struct buf *b, *next;
+
+  for(;;){
+    __sync_synchronize();
+    while(disk.used_idx != disk.used->id){
+      __sync_synchronize();
+      int id = disk.used->elems[disk.used_idx % NUM].id;
+      b = disk.info[id].b;
+
+      if(disk.info[id].status != 0)
+        panic("virtio_disk_intr status");
+
+      disk.info[id].b = 0;
+      free_chain(id);
+      disk.inflight--;
+
+      for(; b; b = next){
+        next = b->rnext;
+        b->disk = 0;   // disk is done with buf
+        if(b->async)
+          bdone(b);
+        else
+          wakeup(b);
+      }
+
+      disk.used_idx += 1;
+    }
+    if(!disk.event_idx)
+      break;
+    // say when to interrupt next, then make sure no
+    // completion slipped in before the device could see that.
+    arm();
+    __sync_synchronize();
+    if(disk.used_idx == disk.used->id)
+      break;
+  }
+
+  // descriptors have been freed; hand waiting requests to the device.
+  dispatch();
 }
 
+// start one read or write of the n bufs in bs[], which must
+// hold consecutive blocks, and return without waiting for it
+// to finish. each b->disk is set until it does; then
+// virtio_disk_intr() clears it and wakes up sleepers on b,
+// or, for b->async, hands b to bdone(). the request goes
+// through the I/O scheduler's queue, so it may be merged
+// with others and reach the device later.
 void
-virtio_disk_intr()
+virtio_disk_start(struct buf **bs, int n, int write)
 {
+  struct buf *b = bs[0];
+  int i;
+
+  if(n < 1 || n > MAXIOBLOCKS)
+    panic("virtio_disk_start");
+
   acquire(&disk.vdisk_lock);
 
-  while((disk.used_idx % NUM) != (disk.used->id % NUM)){
-    int id = disk.used->elems[disk.used_idx].id;
+  for(i = 0; i < n; i++){
+    if(i > 0 && bs[i]->blockno != bs[i-1]->blockno + 1)
+      panic("virtio_disk_start: not consecutive");
+    bs[i]->disk = 1;
+    bs[i]->rnext = (i+1 < n) ? bs[i+1] : 0;
+  }
+  enqueue(b, write, n);
+  dispatch();
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-    
-    disk.info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk.info[id].b);
+  release(&disk.vdisk_lock);
+}
 
-    disk.used_idx = (disk.used_idx + 1) % NUM;
+// wait for virtio_disk_intr() to say that the request
+// started on b, if any, has finished. in poll mode, look
+// at the used ring ourselves instead of sleeping.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  while(b->disk == 1) {
+    if(disk.poll){
+      complete();
+      if(b->disk == 1){
+        // let the interrupt handler in, then look again.
+        release(&disk.vdisk_lock);
+        acquire(&disk.vdisk_lock);
+      }
+    } else {
+      sleep(b, &disk.vdisk_lock);
+    }
   }
+  release(&disk.vdisk_lock);
+}
+
+// turn poll mode on or off; returns the previous setting.
+// interrupts stay enabled either way, so requests nobody
+// waits for, such as read-ahead, still complete.
+int
+virtio_disk_poll(int on)
+{
+  int old;
+
+  acquire(&disk.vdisk_lock);
+  old = disk.poll;
+  disk.poll = on;
+  release(&disk.vdisk_lock);
+  return old;
+}
+
+void
+virtio_disk_intr()
+{
+  acquire(&disk.vdisk_lock);
+
+  // acknowledge first, so that a completion that arrives
+  // while we look at the ring raises a fresh interrupt.
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
+  complete();
+
   release(&disk.vdisk_lock);
 }
@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = FSLOGSIZE + 1;  // Number of log blocks, log super block included
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -40,6 +40,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint ebmap(struct dinode *din, uint fbn);
 
 // convert to intel byte order
 ushort
@@ -76,8 +77,17 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc > 2 && strcmp(argv[1], "-l") == 0){
+    nlog = atoi(argv[2]) + 1;
+    argc -= 2;
+    argv += 2;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l logblocks] fs.img files...\n");
+    exit(1);
+  }
+  if(nlog - 2 < MAXOPRESERVE || nlog - 1 > LOGSIZE){
+    fprintf(stderr, "mkfs: log must hold %d to %d blocks\n", MAXOPRESERVE+1, LOGSIZE);
     exit(1);
   }
 
@@ -238,6 +248,8 @@ ialloc(ushort type)
   din.type = xshort(type);
   din.nlink = xshort(1);
   din.size = xint(0);
+  if(type == T_FILE && FSEXTENTS)
+    din.addrs[0] = xint(EXTMAGIC);
   winode(inum, &din);
   return inum;
 }
@@ -256,6 +268,11 @@ balloc(int used)
   }
   printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
   wsect(sb.bmapstart, buf);
+
+  sb.nfree = xint(FSSIZE - used);
+  memset(buf, 0, sizeof(buf));
+  memmove(buf, &sb, sizeof(sb));
+  wsect(1, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -268,29 +285,43 @@ iappend(uint inum, void *xp, int n)
   struct dinode din;
   char buf[BSIZE];
   uint indirect[NINDIRECT];
-  uint x;
+  uint x, bn, cnt, level;
 
   rinode(inum, &din);
   off = xint(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(xint(din.addrs[0]) == EXTMAGIC){
+      x = ebmap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
+      // find the indirect tree that maps fbn, then walk down it.
+      assert(fbn < MAXFILE);
+      bn = fbn - NDIRECT;
+      cnt = NINDIRECT;
+      for(level = 0; bn >= cnt; level++){
+        bn -= cnt;
+        cnt *= NINDIRECT;
+      }
+      if(xint(din.addrs[NDIRECT+level]) == 0){
+        din.addrs[NDIRECT+level] = xint(freeblock++);
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      x = xint(din.addrs[NDIRECT+level]);
+      while(cnt > 1){
+        cnt /= NINDIRECT;
+        rsect(x, (char*)indirect);
+        if(indirect[bn / cnt] == 0){
+          indirect[bn / cnt] = xint(freeblock++);
+          wsect(x, (char*)indirect);
+        }
+        x = xint(indirect[bn / cnt]);
+        bn %= cnt;
       }
-      x = xint(indirect[fbn-NDIRECT]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
@@ -303,3 +334,27 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Block fbn of extent inode din, which may be the block just
+// past its end. Files are written one at a time, so each is
+// contiguous and needs just one extent.
+uint
+ebmap(struct dinode *din, uint fbn)
+{
+  struct extent *e = (struct extent*)&din->addrs[2];
+  uint len;
+
+  if(xint(din->addrs[1]) == 0){
+    din->addrs[1] = xint(1);
+    e->start = xint(freeblock);
+    e->len = xint(0);
+  }
+  len = xint(e->len);
+  if(fbn == len){
+    assert(xint(e->start) + len == freeblock);
+    freeblock++;
+    e->len = xint(len + 1);
+  }
+  assert(fbn < xint(e->len));
+  return xint(e->start) + fbn;
+}
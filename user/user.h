@@ -1,6 +1,7 @@
 struct stat;
 struct rtcdate;
 struct sysinfo;
+struct rusage;
 
 // system calls
 int fork(void);
@@ -26,6 +27,13 @@ int sleep(int);
 int uptime(void);
 int trace(int); 
 int sysinfo(struct sysinfo*);
+int clone(void(*)(void*), void*, int, void*);
+int join(void**);
+int futex_wait(int*, int);
+int futex_wake(int*, int);
+int getrusage(int, struct rusage*);
+int wait2(int*, struct rusage*);
+int diskpoll(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
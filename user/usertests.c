@@ -7,6 +7,9 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/clone.h"
+#include "kernel/rusage.h"
+#include "kernel/sysinfo.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -523,18 +526,24 @@ writetest(char *s)
   }
 }
 
+// a file without extents, through its direct, single and
+// into its double indirect blocks; unlinking it must free
+// them all.
 void
 writebig(char *s)
 {
+  enum { N = NDIRECT + 2*NINDIRECT };
+  struct sysinfo before, after;
   int i, fd, n;
 
-  fd = open("big", O_CREATE|O_RDWR);
+  fd = open("big", O_CREATE|O_RDWR|O_NOEXTENT);
   if(fd < 0){
     printf("%s: error: creat big failed!\n", s);
     exit(1);
   }
+  sysinfo(&before);
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < N; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", i);
@@ -554,7 +563,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n == N - 1){
         printf("%s: read only %d blocks from big", n);
         exit(1);
       }
@@ -575,6 +584,57 @@ writebig(char *s)
     printf("%s: unlink big failed\n", s);
     exit(1);
   }
+  sysinfo(&after);
+  if(after.nfreeblk != before.nfreeblk){
+    printf("%s: %d free blocks before, %d after unlink\n", s,
+           (int)before.nfreeblk, (int)after.nfreeblk);
+    exit(1);
+  }
+}
+
+// regular files map their blocks with extents, so they can
+// grow well past what direct and single indirect blocks map.
+void
+writebigext(char *s)
+{
+  enum { N = 2*(NDIRECT + NINDIRECT) + 64 };
+  int i, fd, n;
+
+  fd = open("bigext", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: error: creat bigext failed!\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    ((int*)buf)[0] = i;
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: error: write block %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("bigext", O_RDONLY);
+  if(fd < 0){
+    printf("%s: error: open bigext failed!\n", s);
+    exit(1);
+  }
+  for(n = 0; (i = read(fd, buf, BSIZE)) == BSIZE; n++){
+    if(((int*)buf)[0] != n){
+      printf("%s: read content of block %d is %d\n", s,
+             n, ((int*)buf)[0]);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(i != 0 || n != N){
+    printf("%s: read %d blocks of %d\n", s, n, N);
+    exit(1);
+  }
+  if(unlink("bigext") < 0){
+    printf("%s: unlink bigext failed\n", s);
+    exit(1);
+  }
 }
 
 // many creates, followed by unlink test
@@ -1918,7 +1978,7 @@ iref(char *s)
 void
 forktest(char *s)
 {
-  enum{ N = 1000 };
+  enum{ N = 10000 };
   int n, pid;
 
   for(n=0; n<N; n++){
@@ -1935,7 +1995,7 @@ forktest(char *s)
   }
 
   if(n == N){
-    printf("%s: fork claimed to work 1000 times!\n", s);
+    printf("%s: fork claimed to work %d times!\n", s, N);
     exit(1);
   }
 
@@ -1952,6 +2012,526 @@ forktest(char *s)
   }
 }
 
+// threads made by clone() share memory with their creator
+// and are reaped by join(), not wait().
+volatile int clonecount;
+
+void
+cloneworker(void *arg)
+{
+  *(int*)arg = getpid();
+  __sync_fetch_and_add(&clonecount, 1);
+  exit(0);
+}
+
+void
+clonetest(char *s)
+{
+  enum { N = 8, SZ = 4096 };
+  int tids[N], seen[N], i, j, tid;
+  char *stacks[N];
+  void *stack;
+
+  clonecount = 0;
+  for(i = 0; i < N; i++){
+    seen[i] = 0;
+    stacks[i] = malloc(SZ);
+    tids[i] = clone(cloneworker, stacks[i] + SZ, CLONE_VM, &seen[i]);
+    if(tids[i] < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+
+  for(i = 0; i < N; i++){
+    if((tid = join(&stack)) < 0){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < N; j++)
+      if(tids[j] == tid)
+        break;
+    if(j == N || stack != stacks[j] + SZ){
+      printf("%s: join returned unknown thread %d\n", s, tid);
+      exit(1);
+    }
+    free(stacks[j]);
+  }
+
+  if(join(0) != -1 || wait(0) != -1){
+    printf("%s: threads left over\n", s);
+    exit(1);
+  }
+  if(clonecount != N){
+    printf("%s: %d threads ran instead of %d\n", s, clonecount, N);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(seen[i] != tids[i]){
+      printf("%s: thread %d's write not visible\n", s, tids[i]);
+      exit(1);
+    }
+  }
+}
+
+// a mutex that only calls into the kernel when contended.
+// 0: unlocked, 1: locked, 2: locked and maybe waited on.
+volatile int futexmutex;
+int futexcount;
+
+void
+futexlock(volatile int *m)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(m, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __sync_lock_test_and_set(m, 2);
+  while(c != 0){
+    futex_wait((int*)m, 2);
+    c = __sync_lock_test_and_set(m, 2);
+  }
+}
+
+void
+futexunlock(volatile int *m)
+{
+  if(__sync_fetch_and_sub(m, 1) != 1){
+    __atomic_store_n(m, 0, __ATOMIC_SEQ_CST);
+    futex_wake((int*)m, 1);
+  }
+}
+
+void
+futexworker(void *arg)
+{
+  for(int i = 0; i < 1000; i++){
+    futexlock(&futexmutex);
+    futexcount++;
+    futexunlock(&futexmutex);
+  }
+  exit(0);
+}
+
+void
+futextest(char *s)
+{
+  enum { N = 4, SZ = 4096 };
+  char *stacks[N];
+  int i;
+
+  if(futex_wait((int*)&futexmutex, 1) != -1){
+    printf("%s: futex_wait slept on a stale value\n", s);
+    exit(1);
+  }
+
+  futexcount = 0;
+  for(i = 0; i < N; i++){
+    stacks[i] = malloc(SZ);
+    if(clone(futexworker, stacks[i] + SZ, CLONE_VM, 0) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    if(join(0) < 0){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+  }
+  if(futexcount != N*1000){
+    printf("%s: count %d instead of %d\n", s, futexcount, N*1000);
+    exit(1);
+  }
+}
+
+// getrusage() and wait2() should account a child's cpu time,
+// sleeps and disk writes, and pass them on to the parent.
+void
+rusagetest(char *s)
+{
+  struct rusage ru, cru;
+  volatile int x = 0;
+  int i, fd, pid, xstatus;
+
+  if(getrusage(RUSAGE_SELF, &ru) < 0 || ru.stime == 0){
+    printf("%s: getrusage(RUSAGE_SELF) failed\n", s);
+    exit(1);
+  }
+  if(getrusage(2, &ru) != -1){
+    printf("%s: getrusage accepted a bad who\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < 10000000; i++)
+      x++;
+    sleep(1);
+    // no fsync: the blocks reach the disk from the log's
+    // threads, but count as this process's output.
+    fd = open("rusage", O_CREATE|O_RDWR);
+    if(fd < 0 || write(fd, "x", 1) != 1)
+      exit(1);
+    close(fd);
+    if(getrusage(RUSAGE_SELF, &ru) < 0 || ru.oublock == 0){
+      printf("%s: write not counted in oublock\n", s);
+      exit(1);
+    }
+    unlink("rusage");
+    exit(0);
+  }
+
+  if(wait2(&xstatus, &ru) != pid || xstatus != 0){
+    printf("%s: wait2 failed\n", s);
+    exit(1);
+  }
+  if(ru.utime == 0 || ru.stime == 0 || ru.nvcsw == 0 || ru.oublock == 0){
+    printf("%s: child usage not accounted\n", s);
+    exit(1);
+  }
+  if(getrusage(RUSAGE_CHILDREN, &cru) < 0 || cru.utime < ru.utime ||
+     cru.oublock < ru.oublock){
+    printf("%s: RUSAGE_CHILDREN missing the child\n", s);
+    exit(1);
+  }
+}
+
+// the buffer cache should grow past NBUF to hold a file
+// bigger than that, and then serve it without going to disk.
+void
+bcachegrow(char *s)
+{
+  enum { N = 2*NBUF };
+  struct sysinfo before, after;
+  char buf[BSIZE];
+  int i, fd;
+
+  fd = open("bcachegrow", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'b', sizeof(buf));
+  for(i = 0; i < N; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  sysinfo(&before);
+  fd = open("bcachegrow", O_RDONLY);
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  sysinfo(&after);
+  unlink("bcachegrow");
+
+  if(after.nbuf <= NBUF){
+    printf("%s: cache did not grow past %d buffers\n", s, NBUF);
+    exit(1);
+  }
+  if(after.bhit - before.bhit < N){
+    printf("%s: only %d hits re-reading %d blocks\n", s,
+           (int)(after.bhit - before.bhit), N);
+    exit(1);
+  }
+}
+
+// the free block count should follow files' allocations.
+void
+freeblocks(char *s)
+{
+  enum { N = 20 };
+  struct sysinfo before, mid, after;
+  char buf[BSIZE];
+  int i, fd;
+
+  fd = open("freeblocks", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  sysinfo(&before);
+  memset(buf, 'f', sizeof(buf));
+  for(i = 0; i < N; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  sysinfo(&mid);
+  unlink("freeblocks");
+  sysinfo(&after);
+
+  if(before.nfreeblk - mid.nfreeblk < N){
+    printf("%s: %d free blocks before, %d after writing %d\n", s,
+           (int)before.nfreeblk, (int)mid.nfreeblk, N);
+    exit(1);
+  }
+  if(after.nfreeblk != before.nfreeblk){
+    printf("%s: %d free blocks before, %d after unlink\n", s,
+           (int)before.nfreeblk, (int)after.nfreeblk);
+    exit(1);
+  }
+}
+
+// file I/O should work the same with the disk driver
+// polling for completions.
+void
+diskpolltest(char *s)
+{
+  char buf[BSIZE];
+  int i, fd, old;
+
+  old = diskpoll(1);
+  fd = open("diskpoll", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 20; i++){
+    memset(buf, i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  fd = open("diskpoll", O_RDONLY);
+  for(i = 0; i < 20; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[0] != i ||
+       buf[BSIZE-1] != i){
+      printf("%s: read back wrong data\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("diskpoll");
+  if(diskpoll(old) != 1){
+    printf("%s: diskpoll did not stick\n", s);
+    exit(1);
+  }
+}
+
+// several processes writing big files at once, each write
+// spanning more than one log transaction.
+void
+logconcurrent(char *s)
+{
+  enum { NCHILD=4, SZ=60*BSIZE };
+  char name[] = "logc0";
+  int i, j, fd, pid, xstatus;
+  char *buf;
+
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      name[4] = '0' + i;
+      buf = malloc(SZ);
+      for(j = 0; j < SZ; j++)
+        buf[j] = i + j/BSIZE;
+      fd = open(name, O_CREATE|O_RDWR);
+      if(fd < 0){
+        printf("%s: open %s failed\n", s, name);
+        exit(1);
+      }
+      if(write(fd, buf, SZ) != SZ){
+        printf("%s: write %s failed\n", s, name);
+        exit(1);
+      }
+      close(fd);
+      exit(0);
+    }
+  }
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+
+  buf = malloc(BSIZE);
+  for(i = 0; i < NCHILD; i++){
+    name[4] = '0' + i;
+    fd = open(name, O_RDONLY);
+    for(j = 0; j < SZ/BSIZE; j++){
+      if(read(fd, buf, BSIZE) != BSIZE || buf[0] != (char)(i+j) ||
+         buf[BSIZE-1] != (char)(i+j)){
+        printf("%s: %s has wrong data\n", s, name);
+        exit(1);
+      }
+    }
+    close(fd);
+    unlink(name);
+  }
+  free(buf);
+}
+
+// open(O_CREATE|O_TRUNC) makes the biggest log reservation
+// (MAXOPRESERVE); it must fit even the smallest log mkfs
+// accepts. Run usertests on an image made with
+// make LOGBLOCKS=<MAXOPRESERVE+1> to check that.
+void
+createtrunc(char *s)
+{
+  char buf[BSIZE];
+  int i, fd;
+
+  memset(buf, 'c', sizeof(buf));
+  for(i = 0; i < 2; i++){
+    // the first round creates the file, the second truncates it.
+    fd = open("createtrunc", O_CREATE|O_TRUNC|O_RDWR);
+    if(fd < 0){
+      printf("%s: open failed\n", s);
+      exit(1);
+    }
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+  if(unlink("createtrunc") != 0){
+    printf("%s: unlink failed\n", s);
+    exit(1);
+  }
+}
+
+// more inodes than NINODE can be in use at once.
+void
+manyinodes(char *s)
+{
+  enum { NCHILD=5, NF=12 };
+  char name[] = "mi00";
+  int i, j, fd, pid, xstatus, fds[2], ready[2];
+  char c;
+
+  if(pipe(fds) != 0 || pipe(ready) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[1]);
+      close(ready[0]);
+      name[2] = '0' + i;
+      for(j = 0; j < NF; j++){
+        name[3] = 'a' + j;
+        if(open(name, O_CREATE|O_RDWR) < 0){
+          printf("%s: open %s failed\n", s, name);
+          exit(1);
+        }
+      }
+      // hold them open until every child has its files.
+      write(ready[1], "x", 1);
+      close(ready[1]);
+      read(fds[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  close(ready[1]);
+  for(i = 0; i < NCHILD; i++){
+    if(read(ready[0], &c, 1) != 1){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  close(ready[0]);
+  close(fds[1]);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+
+  for(i = 0; i < NCHILD; i++){
+    name[2] = '0' + i;
+    for(j = 0; j < NF; j++){
+      name[3] = 'a' + j;
+      fd = open(name, O_RDONLY);
+      if(fd < 0){
+        printf("%s: %s missing\n", s, name);
+        exit(1);
+      }
+      close(fd);
+      unlink(name);
+    }
+  }
+}
+
+// names looked up before must still come and go
+// with link, unlink, and directory reuse.
+void
+dcachetest(char *s)
+{
+  int i, fd;
+
+  for(i = 0; i < 3; i++){
+    if(open("dc/f", O_RDONLY) >= 0){
+      printf("%s: open dc/f succeeded before mkdir\n", s);
+      exit(1);
+    }
+    if(mkdir("dc") != 0){
+      printf("%s: mkdir dc failed\n", s);
+      exit(1);
+    }
+    if(open("dc/f", O_RDONLY) >= 0){
+      printf("%s: open dc/f succeeded before create\n", s);
+      exit(1);
+    }
+    fd = open("dc/f", O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: create dc/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(link("dc/f", "dc/g") != 0){
+      printf("%s: link failed\n", s);
+      exit(1);
+    }
+    if(unlink("dc/f") != 0){
+      printf("%s: unlink dc/f failed\n", s);
+      exit(1);
+    }
+    if(open("dc/f", O_RDONLY) >= 0){
+      printf("%s: open dc/f succeeded after unlink\n", s);
+      exit(1);
+    }
+    fd = open("dc/g", O_RDONLY);
+    if(fd < 0){
+      printf("%s: open dc/g failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dc/g") != 0 || unlink("dc") != 0){
+      printf("%s: unlink dc failed\n", s);
+      exit(1);
+    }
+  }
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2679,6 +3259,7 @@ main(int argc, char *argv[])
     {opentest, "opentest"},
     {writetest, "writetest"},
     {writebig, "writebig"},
+    {writebigext, "writebigext"},
     {createtest, "createtest"},
     {openiputtest, "openiput"},
     {exitiputtest, "exitiput"},
@@ -2693,6 +3274,16 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {clonetest, "clonetest"},
+    {futextest, "futextest"},
+    {rusagetest, "rusagetest"},
+    {bcachegrow, "bcachegrow"},
+    {freeblocks, "freeblocks"},
+    {diskpolltest, "diskpolltest"},
+    {logconcurrent, "logconcurrent"},
+    {createtrunc, "createtrunc"},
+    {manyinodes, "manyinodes"},
+    {dcachetest, "dcachetest"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
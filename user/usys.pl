@@ -37,4 +37,11 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("trace");
-entry("sysinfo");
\ No newline at end of file
+entry("sysinfo");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
+entry("getrusage");
+entry("wait2");
+entry("diskpoll");
\ No newline at end of file